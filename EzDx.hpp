@@ -1,19 +1,25 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <d3d12.h>
+#include <deque>
 #include <dxgi1_6.h>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
 #include <random>
 
 #include "d3dx12.h"
 #include "d3d12shader.h"
-#include "dxcapi.h"
 
 #ifdef max
 #undef max
@@ -22,79 +28,10 @@
 #undef min
 #endif
 
-#define DX_ASSERT( status, message )                                                             \
-	if ( ( status ) == 0 )                                                                       \
-	{                                                                                            \
-		char buffer[512];                                                                        \
-		snprintf( buffer, sizeof( buffer ), "%s, %s (%d line)\n", message, __FILE__, __LINE__ ); \
-		__debugbreak();                                                                          \
-	}
+#include "EzDxCompiler.hpp"
 
 namespace ezdx {
 
-template <class T>
-class DxPtr
-{
-public:
-	DxPtr() {}
-	DxPtr( T* ptr ) : _ptr( ptr )
-	{
-	}
-	DxPtr( const DxPtr<T>& rhs ) : _ptr( rhs._ptr )
-	{
-		if ( _ptr )
-		{
-			_ptr->AddRef();
-		}
-	}
-	DxPtr<T>& operator=( const DxPtr<T>& rhs )
-	{
-		auto p = _ptr;
-
-		if ( rhs._ptr )
-		{
-			rhs._ptr->AddRef();
-		}
-		_ptr = rhs._ptr;
-
-		if ( p )
-		{
-			p->Release();
-		}
-		return *this;
-	}
-	~DxPtr()
-	{
-		if ( _ptr )
-		{
-			_ptr->Release();
-		}
-	}
-	T* get()
-	{
-		return _ptr;
-	}
-	const T* get() const
-	{
-		return _ptr;
-	}
-	T* operator->()
-	{
-		return _ptr;
-	}
-	T** getAddressOf()
-	{
-		return &_ptr;
-	}
-	operator bool()
-	{
-		return _ptr != nullptr;
-	}
-
-private:
-	T* _ptr = nullptr;
-};
-
 inline void enableDebugLayer()
 {
 	DxPtr<ID3D12Debug> debugController;
@@ -159,10 +96,120 @@ static HRESULT assertResourceState( ID3D12GraphicsCommandList* commandList, ID3D
 	return S_OK;
 }
 
-inline int64_t alignedExpand( int64_t x, int64_t align )
+enum class FenceWaitPolicy
 {
-	return ( ( x + align - 1 ) / align ) * align;
-}
+	Block,
+	SpinThenBlock
+};
+
+/*
+ One ID3D12Fence per queue with monotonically increasing values.
+ signal() hands out a ticket that can be polled with isComplete() or waited with waitFor().
+*/
+class TimelineFence
+{
+public:
+	TimelineFence( const TimelineFence& ) = delete;
+	void operator=( const TimelineFence& ) = delete;
+
+	TimelineFence( ID3D12Device* device )
+	{
+		HRESULT hr;
+		hr = device->CreateFence( 0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS( _fence.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+	}
+	~TimelineFence()
+	{
+		for ( HANDLE e : _events )
+		{
+			CloseHandle( e );
+		}
+	}
+	// the lock keeps the values signaled on the queue in increasing order when threads submit at the same time
+	uint64_t signal( ID3D12CommandQueue* queue )
+	{
+		std::lock_guard<std::mutex> lock( _signalMutex );
+		uint64_t value = ++_lastSignaled;
+		HRESULT hr;
+		hr = queue->Signal( _fence.get(), value );
+		DX_ASSERT( hr == S_OK, "" );
+		return value;
+	}
+	uint64_t lastSignaled() const
+	{
+		return _lastSignaled;
+	}
+	bool isComplete( uint64_t value )
+	{
+		if ( value <= _completed )
+		{
+			return true;
+		}
+		_completed = _fence->GetCompletedValue();
+		return value <= _completed;
+	}
+
+	// SpinThenBlock polls the fence spinCount times before sleeping on an event, which is cheaper for waits shorter than a thread wake up.
+	void waitFor( uint64_t value, FenceWaitPolicy policy = FenceWaitPolicy::Block, int spinCount = 4096 )
+	{
+		if ( isComplete( value ) )
+		{
+			return;
+		}
+		if ( policy == FenceWaitPolicy::SpinThenBlock )
+		{
+			for ( int i = 0; i < spinCount; ++i )
+			{
+				YieldProcessor();
+				if ( isComplete( value ) )
+				{
+					return;
+				}
+			}
+		}
+
+		HANDLE e = acquireEvent();
+		HRESULT hr;
+		hr = _fence->SetEventOnCompletion( value, e );
+		DX_ASSERT( hr == S_OK, "" );
+		WaitForSingleObject( e, INFINITE );
+		releaseEvent( e );
+
+		isComplete( value );
+	}
+	void waitForIdle()
+	{
+		waitFor( _lastSignaled );
+	}
+	ID3D12Fence* fence()
+	{
+		return _fence.get();
+	}
+private:
+	HANDLE acquireEvent()
+	{
+		std::lock_guard<std::mutex> lock( _eventMutex );
+		if ( _events.empty() )
+		{
+			return CreateEvent( nullptr, false, false, nullptr );
+		}
+		HANDLE e = _events.back();
+		_events.pop_back();
+		return e;
+	}
+	void releaseEvent( HANDLE e )
+	{
+		std::lock_guard<std::mutex> lock( _eventMutex );
+		_events.push_back( e );
+	}
+
+	DxPtr<ID3D12Fence> _fence;
+	std::atomic<uint64_t> _lastSignaled { 0 };
+	std::atomic<uint64_t> _completed { 0 };
+	std::mutex _signalMutex;
+	std::mutex _eventMutex;
+	std::vector<HANDLE> _events;
+};
 
 class CommandObject
 {
@@ -183,192 +230,1780 @@ public:
 			nullptr, /* pipeline state */
 			IID_PPV_ARGS( _list.getAddressOf() ) );
 		DX_ASSERT( hr == S_OK, "" );
+		_list->Close();
 	}
 	ID3D12GraphicsCommandList* list()
 	{
 		return _list.get();
 	}
+
+	// the previous submission of this object must be completed on the GPU.
+	void begin()
+	{
+		HRESULT hr;
+		hr = _allocator->Reset();
+		DX_ASSERT( hr == S_OK, "" );
+		hr = _list->Reset( _allocator.get(), nullptr );
+		DX_ASSERT( hr == S_OK, "" );
+	}
+	void end()
+	{
+		HRESULT hr;
+		hr = _list->Close();
+		DX_ASSERT( hr == S_OK, "" );
+	}
 	void scopedStoreCommand( std::function<void( ID3D12GraphicsCommandList* commandList )> f )
 	{
-		if (_isClosed)
-		{
-			_list->Reset(_allocator.get(), nullptr);
-		}
-
+		begin();
 		f( _list.get() );
-		_list->Close();
-		_isClosed = true;
+		end();
+	}
+
+	// fence value of the last submission
+	uint64_t fenceValue() const
+	{
+		return _fenceValue;
+	}
+	void setFenceValue( uint64_t fenceValue )
+	{
+		_fenceValue = fenceValue;
 	}
 private:
-	bool _isClosed = false;
+	uint64_t _fenceValue = 0;
 	DxPtr<ID3D12CommandAllocator> _allocator;
 	DxPtr<ID3D12GraphicsCommandList> _list;
 };
 
-class DeviceObject
+/*
+ Allocator/list pairs recycled in submission order once the GPU has passed their fence value.
+*/
+class CommandPool
 {
 public:
-	DeviceObject( const DeviceObject& ) = delete;
-	void operator=( const DeviceObject& ) = delete;
+	CommandPool( const CommandPool& ) = delete;
+	void operator=( const CommandPool& ) = delete;
 
-	DeviceObject( IDXGIAdapter* adapter )
+	CommandPool( ID3D12Device* device, TimelineFence* fence, int maxObjects = 64 ) : _fence( fence ), _maxObjects( maxObjects )
 	{
-		HRESULT hr;
-
-		DXGI_ADAPTER_DESC d;
-		hr = adapter->GetDesc( &d );
-		DX_ASSERT( hr == S_OK, "" );
-
-		_deviceName = d.Description;
-
-		struct DeviceIID
-		{
-			IID iid;
-			const char* type;
-		};
-#define DEVICE_VER( type )      \
-	{                           \
-		__uuidof( type ), #type \
+		device->AddRef();
+		_device = DxPtr<ID3D12Device>( device );
 	}
-		const DeviceIID deviceIIDs[] = {
-			DEVICE_VER( ID3D12Device8 ),
-			DEVICE_VER( ID3D12Device7 ),
-			DEVICE_VER( ID3D12Device6 ),
-			DEVICE_VER( ID3D12Device5 ),
-			DEVICE_VER( ID3D12Device4 ),
-			DEVICE_VER( ID3D12Device3 ),
-			DEVICE_VER( ID3D12Device2 ),
-			DEVICE_VER( ID3D12Device1 ),
-		};
-#undef DEVICE_VER
 
-		for ( auto deviceIID : deviceIIDs )
+	// returns an object that is ready for begin(). blocks only when maxObjects submissions are in flight.
+	CommandObject* acquire()
+	{
+		std::unique_lock<std::mutex> lock( _mutex );
+		if ( !_submitted.empty() )
 		{
-			hr = D3D12CreateDevice( adapter, D3D_FEATURE_LEVEL_12_0, deviceIID.iid, (void**)_device.getAddressOf() );
-			if ( hr == S_OK )
+			CommandObject* oldest = _submitted.front();
+			if ( _fence->isComplete( oldest->fenceValue() ) || _objects.size() >= (size_t)_maxObjects )
 			{
-				_deviceIIDType = deviceIID.type;
-				break;
+				_submitted.pop_front();
+				lock.unlock();
+				_fence->waitFor( oldest->fenceValue() );
+				return oldest;
 			}
 		}
-		DX_ASSERT( hr == S_OK, "" );
-
-		D3D12_FEATURE_DATA_SHADER_MODEL shaderModelFeature = {};
-		shaderModelFeature.HighestShaderModel = D3D_SHADER_MODEL_6_6;
-		hr = _device->CheckFeatureSupport( D3D12_FEATURE_SHADER_MODEL, &shaderModelFeature, sizeof( shaderModelFeature ) );
-		DX_ASSERT( hr == S_OK, "" );
-
-		std::map<D3D_SHADER_MODEL, std::string> sm_to_s =
-			{
-				{ D3D_SHADER_MODEL_5_1, "D3D_SHADER_MODEL_5_1" },
-				{ D3D_SHADER_MODEL_6_0, "D3D_SHADER_MODEL_6_0" },
-				{ D3D_SHADER_MODEL_6_1, "D3D_SHADER_MODEL_6_1" },
-				{ D3D_SHADER_MODEL_6_2, "D3D_SHADER_MODEL_6_2" },
-				{ D3D_SHADER_MODEL_6_3, "D3D_SHADER_MODEL_6_3" },
-				{ D3D_SHADER_MODEL_6_4, "D3D_SHADER_MODEL_6_4" },
-				{ D3D_SHADER_MODEL_6_5, "D3D_SHADER_MODEL_6_5" },
-				{ D3D_SHADER_MODEL_6_6, "D3D_SHADER_MODEL_6_6" },
-			};
-		_highestShaderModel = sm_to_s[shaderModelFeature.HighestShaderModel];
-
-		D3D12_FEATURE_DATA_D3D12_OPTIONS1 option1 = {};
-		hr = _device->CheckFeatureSupport( D3D12_FEATURE_D3D12_OPTIONS1, &option1, sizeof( option1 ) );
-		DX_ASSERT( hr == S_OK, "" );
-		_waveLaneCount = option1.WaveLaneCountMin;
-		_totalLaneCount = option1.TotalLaneCount;
-
-		D3D12_COMMAND_QUEUE_DESC commandQueueDesk = {};
-		commandQueueDesk.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
-		commandQueueDesk.Priority = D3D12_COMMAND_QUEUE_PRIORITY_HIGH;
-		commandQueueDesk.Flags = D3D12_COMMAND_QUEUE_FLAG_DISABLE_GPU_TIMEOUT;
-		commandQueueDesk.NodeMask = 0;
-		hr = _device->CreateCommandQueue(&commandQueueDesk, IID_PPV_ARGS(_queue.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
+		_objects.emplace_back( new CommandObject( _device.get() ) );
+		return _objects.back().get();
+	}
 
-		_command = std::unique_ptr<CommandObject>( new CommandObject( _device.get() ) );
+	// fenceValue is the value signaled after the object's list was executed.
+	void release( CommandObject* object, uint64_t fenceValue )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		object->setFenceValue( fenceValue );
+		_submitted.push_back( object );
+	}
+	int size() const
+	{
+		return _objects.size();
+	}
+private:
+	DxPtr<ID3D12Device> _device;
+	TimelineFence* _fence;
+	int _maxObjects;
+	std::mutex _mutex;
+	std::vector<std::unique_ptr<CommandObject>> _objects;
+	std::deque<CommandObject*> _submitted;
+};
 
-		DxPtr<IDXGIFactory4> pDxgiFactory;
-		hr = CreateDXGIFactory1( __uuidof( IDXGIFactory1 ), (void**)pDxgiFactory.getAddressOf() );
-		DX_ASSERT( hr == S_OK, "" );
+/*
+ State of a resource at the end of the most recently recorded command list.
+ It stays correct as long as contexts are submitted in the order they were recorded.
+ lastUse only covers work recorded through CommandContext state tracking.
+*/
+struct ResourceState
+{
+	ID3D12Resource* resource = nullptr;
+	D3D12_RESOURCE_STATES state = D3D12_RESOURCE_STATE_COMMON;
+	uint64_t lastUse = 0;   // fence value of the latest submission that accessed the resource
+	int recording = 0;      // the number of open contexts that accessed the resource. it is in use until all of them are submitted
+	uint64_t recorder = 0;  // the context that accessed it last. skips duplicates in the list of the context
+};
 
-		DXGI_SWAP_CHAIN_DESC1 swapChainDesc = {};
-		swapChainDesc.BufferCount = 2;
-		swapChainDesc.Width = 64;
-		swapChainDesc.Height = 64;
-		swapChainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-		swapChainDesc.SampleDesc.Count = 1;
+/*
+ Records many commands into one list and submits them with a single ExecuteCommandLists.
+ Binding the same pipeline, root signature or descriptor heap again is skipped.
+ Resource barriers are collected and issued as one batch right before the command that needs them.
+*/
+class CommandContext
+{
+public:
+	CommandContext( const CommandContext& ) = delete;
+	void operator=( const CommandContext& ) = delete;
 
-		// Create the swap chain
-		hr = pDxgiFactory->CreateSwapChainForComposition( _queue.get(), &swapChainDesc, nullptr, _swapchain.getAddressOf() );
-		DX_ASSERT( hr == S_OK, "" );
+	CommandContext( CommandPool* pool, TimelineFence* fence, ID3D12CommandQueue* queue )
+		: _pool( pool ), _fence( fence ), _queue( queue ), _id( nextId() )
+	{
+		_command = _pool->acquire();
+		_command->begin();
 	}
-	ID3D12Device* device()
+	CommandContext( CommandContext&& rhs )
+		: _pool( rhs._pool ), _fence( rhs._fence ), _queue( rhs._queue ), _id( rhs._id ), _command( rhs._command ),
+		  _pipelineState( rhs._pipelineState ), _rootSignature( rhs._rootSignature ), _descriptorHeap( rhs._descriptorHeap ),
+		  _barriers( std::move( rhs._barriers ) ), _unorderedAccessed( std::move( rhs._unorderedAccessed ) ), _touched( std::move( rhs._touched ) )
 	{
-		return _device.get();
+		rhs._command = nullptr;
 	}
-	void present()
+	~CommandContext()
 	{
-		HRESULT hr;
-		hr = _swapchain->Present( 1, 0 );
-		DX_ASSERT( hr == S_OK, "" );
+		if ( isOpen() )
+		{
+			submit();
+		}
 	}
-	std::wstring deviceName() const
+	bool isOpen() const
 	{
-		return _deviceName;
+		return _command != nullptr;
 	}
-	int waveLaneCount() const
+	ID3D12GraphicsCommandList* list()
 	{
-		return _waveLaneCount;
+		DX_ASSERT( isOpen(), "" );
+		return _command->list();
 	}
-	int totalLaneCount() const
+	void setPipelineState( ID3D12PipelineState* pipelineState )
 	{
-		return _totalLaneCount;
+		if ( _pipelineState != pipelineState )
+		{
+			list()->SetPipelineState( pipelineState );
+			_pipelineState = pipelineState;
+		}
 	}
-	ID3D12CommandQueue* queue()
+	void setComputeRootSignature( ID3D12RootSignature* rootSignature )
 	{
-		return _queue.get();
+		if ( _rootSignature != rootSignature )
+		{
+			list()->SetComputeRootSignature( rootSignature );
+			_rootSignature = rootSignature;
+		}
 	}
-	void executeCommand(std::function<void(ID3D12GraphicsCommandList* commandList)> f)
+	void setDescriptorHeap( ID3D12DescriptorHeap* descriptorHeap )
 	{
-		_command->scopedStoreCommand( f );
-		ID3D12CommandList* const command[] = { _command->list() };
-		_queue->ExecuteCommandLists( 1, command );
+		if ( _descriptorHeap != descriptorHeap )
+		{
+			list()->SetDescriptorHeaps( 1, &descriptorHeap );
+			_descriptorHeap = descriptorHeap;
+		}
 	}
-private:
-	std::string _deviceIIDType;
-	std::wstring _deviceName;
-	std::string _highestShaderModel;
-	int _waveLaneCount = 0;
-	int _totalLaneCount = 0;
-	DxPtr<ID3D12Device> _device;
-	DxPtr<ID3D12CommandQueue> _queue;
-	DxPtr<IDXGISwapChain1> _swapchain;
-	std::unique_ptr<CommandObject> _command;
-};
-class FenceObject
-{
-public:
-	FenceObject(const FenceObject&) = delete;
-	void operator=(const FenceObject&) = delete;
 
-	FenceObject(DeviceObject* deviceObject)
+	void transition( ResourceState* resource, D3D12_RESOURCE_STATES after )
 	{
-		HRESULT hr;
-		hr = deviceObject->device()->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(_fence.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
-		hr = deviceObject->queue()->Signal(_fence.get(), 1);
+		touch( resource );
+		if ( resource->state == after )
+		{
+			return;
+		}
+
+		// fold into a transition of the same resource that is still pending.
+		auto pending = pendingTransition( resource );
+		if ( pending == _barriers.end() )
+		{
+			_barriers.push_back( CD3DX12_RESOURCE_BARRIER::Transition( resource->resource, resource->state, after ) );
+		}
+		else if ( pending->Transition.StateBefore == after )
+		{
+			_barriers.erase( pending );
+		}
+		else
+		{
+			pending->Transition.StateAfter = after;
+		}
+		resource->state = after;
+	}
+	void uavBarrier( ResourceState* resource )
+	{
+		touch( resource );
+		for ( const D3D12_RESOURCE_BARRIER& b : _barriers )
+		{
+			if ( b.Type == D3D12_RESOURCE_BARRIER_TYPE_UAV && b.UAV.pResource == resource->resource )
+			{
+				return;
+			}
+		}
+		_barriers.push_back( CD3DX12_RESOURCE_BARRIER::UAV( resource->resource ) );
+		removeUnorderedAccessed( resource );
+	}
+
+	// tracks an object that the list refers to without any barrier, e.g. a pipeline. lastUse is updated by submit().
+	void use( ResourceState* object )
+	{
+		touch( object );
+	}
+
+	// call before a command that accesses the resource as UAV. a barrier is queued only when an earlier command of this list accessed it as UAV.
+	void beginUnorderedAccess( ResourceState* resource )
+	{
+		touch( resource );
+		if ( resource->state != D3D12_RESOURCE_STATE_UNORDERED_ACCESS )
+		{
+			transition( resource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS );
+		}
+
+		// a pending transition orders the earlier access. it is gone when the transition folded back to UAV.
+		if ( pendingTransition( resource ) == _barriers.end() &&
+			 std::find( _unorderedAccessed.begin(), _unorderedAccessed.end(), resource ) != _unorderedAccessed.end() )
+		{
+			uavBarrier( resource );
+		}
+	}
+	// call after the command.
+	void endUnorderedAccess( ResourceState* resource )
+	{
+		if ( std::find( _unorderedAccessed.begin(), _unorderedAccessed.end(), resource ) == _unorderedAccessed.end() )
+		{
+			_unorderedAccessed.push_back( resource );
+		}
+	}
+	void flushBarriers()
+	{
+		if ( _barriers.empty() )
+		{
+			return;
+		}
+		list()->ResourceBarrier( _barriers.size(), _barriers.data() );
+
+		// a transition also orders the previous unordered accesses. a transition folded back to its StateBefore is not here, so they still need a UAV barrier.
+		_unorderedAccessed.erase( std::remove_if( _unorderedAccessed.begin(), _unorderedAccessed.end(), [this]( ResourceState* resource ) {
+			return pendingTransition( resource ) != _barriers.end();
+		} ), _unorderedAccessed.end() );
+		_barriers.clear();
+	}
+
+	// closes and executes the list. returns the fence value signaled after it.
+	uint64_t submit()
+	{
+		DX_ASSERT( isOpen(), "" );
+		flushBarriers();
+		_unorderedAccessed.clear();
+		_command->end();
+		ID3D12CommandList* const lists[] = { _command->list() };
+		_queue->ExecuteCommandLists( 1, lists );
+		uint64_t ticket = _fence->signal( _queue );
+		_pool->release( _command, ticket );
+		_command = nullptr;
+
+		for ( ResourceState* resource : _touched )
+		{
+			resource->lastUse = std::max( resource->lastUse, ticket );
+			resource->recording--;
+			if ( resource->recorder == _id )
+			{
+				resource->recorder = 0;
+			}
+		}
+		_touched.clear();
+		return ticket;
+	}
+private:
+	// a resource that another context touched in between is listed twice, which keeps recording balanced
+	void touch( ResourceState* resource )
+	{
+		if ( resource->recorder != _id )
+		{
+			resource->recorder = _id;
+			resource->recording++;
+			_touched.push_back( resource );
+		}
+	}
+	static uint64_t nextId()
+	{
+		static std::atomic<uint64_t> id { 0 };
+		return ++id;
+	}
+	std::vector<D3D12_RESOURCE_BARRIER>::iterator pendingTransition( ResourceState* resource )
+	{
+		return std::find_if( _barriers.begin(), _barriers.end(), [resource]( const D3D12_RESOURCE_BARRIER& b ) {
+			return b.Type == D3D12_RESOURCE_BARRIER_TYPE_TRANSITION && b.Transition.pResource == resource->resource;
+		} );
+	}
+	void removeUnorderedAccessed( ResourceState* resource )
+	{
+		_unorderedAccessed.erase( std::remove( _unorderedAccessed.begin(), _unorderedAccessed.end(), resource ), _unorderedAccessed.end() );
+	}
+
+	CommandPool* _pool;
+	TimelineFence* _fence;
+	ID3D12CommandQueue* _queue;
+	uint64_t _id;
+	CommandObject* _command;
+	ID3D12PipelineState* _pipelineState = nullptr;
+	ID3D12RootSignature* _rootSignature = nullptr;
+	ID3D12DescriptorHeap* _descriptorHeap = nullptr;
+	std::vector<D3D12_RESOURCE_BARRIER> _barriers;
+
+	// resources accessed as UAV since their last barrier
+	std::vector<ResourceState*> _unorderedAccessed;
+
+	// resources whose lastUse is updated by submit()
+	std::vector<ResourceState*> _touched;
+};
+
+/*
+ Persistently mapped D3D12_HEAP_TYPE_UPLOAD or D3D12_HEAP_TYPE_READBACK ring.
+ Every allocation is retired with a fence value after its copy is submitted, and the memory is reused once the GPU has passed that value.
+ Readback allocations additionally stay alive until the host calls release().
+*/
+class StagingRing
+{
+public:
+	struct Allocation
+	{
+		ID3D12Resource* resource = nullptr;
+		int64_t offset = 0;
+		int64_t bytes = 0;
+		uint8_t* ptr = nullptr;
+	};
+
+	StagingRing( const StagingRing& ) = delete;
+	void operator=( const StagingRing& ) = delete;
+
+	StagingRing( ID3D12Device* device, TimelineFence* fence, D3D12_HEAP_TYPE heapType, int64_t capacity ) : _heapType( heapType ), _capacity( capacity ), _fence( fence )
+	{
+		DX_ASSERT( heapType == D3D12_HEAP_TYPE_UPLOAD || heapType == D3D12_HEAP_TYPE_READBACK, "" );
+		bool upload = heapType == D3D12_HEAP_TYPE_UPLOAD;
+
+		HRESULT hr;
+		CD3DX12_HEAP_PROPERTIES heapProperties( heapType );
+		CD3DX12_RESOURCE_DESC resourceDesc = CD3DX12_RESOURCE_DESC::Buffer( _capacity );
+		hr = device->CreateCommittedResource(
+			&heapProperties,
+			D3D12_HEAP_FLAG_NONE,
+			&resourceDesc,
+			upload ? D3D12_RESOURCE_STATE_GENERIC_READ : D3D12_RESOURCE_STATE_COPY_DEST,
+			nullptr,
+			IID_PPV_ARGS( _resource.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+		_resource->SetName( upload ? L"UploadRing" : L"ReadbackRing" );
+
+		// no read for upload. whole range for readback.
+		D3D12_RANGE range = { 0, upload ? 0 : (SIZE_T)_capacity };
+		void* p;
+		hr = _resource->Map( 0, &range, &p );
+		DX_ASSERT( hr == S_OK, "" );
+		_ptr = (uint8_t*)p;
+	}
+	~StagingRing()
+	{
+		_fence->waitFor( _lastRetired );
+		D3D12_RANGE range = { 0, _heapType == D3D12_HEAP_TYPE_UPLOAD ? (SIZE_T)_capacity : 0 };
+		_resource->Unmap( 0, &range );
+	}
+	int64_t capacity() const
+	{
+		return _capacity;
+	}
+
+	/*
+	 Blocks only while older submitted copies are still using the ring.
+	 Returns an allocation with ptr == nullptr when the request cannot be satisfied because the space is held by unsubmitted or unreleased allocations.
+	*/
+	Allocation allocate( int64_t bytes, int64_t alignment )
+	{
+		bytes = std::max( bytes, (int64_t)1 );
+		DX_ASSERT( bytes <= _capacity, "" );
+
+		std::unique_lock<std::mutex> lock( _mutex );
+		for ( ;; )
+		{
+			reclaim();
+
+			int64_t offset;
+			if ( findSpace( bytes, alignment, &offset ) )
+			{
+				_blocks.push_back( { offset, offset + bytes, 0, _heapType == D3D12_HEAP_TYPE_UPLOAD } );
+
+				Allocation a;
+				a.resource = _resource.get();
+				a.offset = offset;
+				a.bytes = bytes;
+				a.ptr = _ptr + offset;
+				return a;
+			}
+
+			const Block& oldest = _blocks.front();
+			if ( oldest.fenceValue == 0 || !oldest.released )
+			{
+				return Allocation();
+			}
+
+			// other threads can retire and release while this one waits
+			uint64_t fenceValue = oldest.fenceValue;
+			lock.unlock();
+			_fence->waitFor( fenceValue );
+			lock.lock();
+		}
+	}
+
+	// fenceValue is the ticket of the submission that copies from or into the allocation.
+	void retire( const Allocation& allocation, uint64_t fenceValue )
+	{
+		DX_ASSERT( fenceValue != 0, "" );
+		std::lock_guard<std::mutex> lock( _mutex );
+		_lastRetired = std::max( _lastRetired, fenceValue );
+
+		Block* block = find( allocation );
+		DX_ASSERT( block->fenceValue == 0, "" );
+		block->fenceValue = fenceValue;
+	}
+
+	// readback only. the host has finished reading the allocation.
+	void release( const Allocation& allocation )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		find( allocation )->released = true;
+	}
+private:
+	void reclaim()
+	{
+		while ( !_blocks.empty() && _blocks.front().fenceValue != 0 && _blocks.front().released && _fence->isComplete( _blocks.front().fenceValue ) )
+		{
+			_blocks.pop_front();
+		}
+	}
+	bool findSpace( int64_t bytes, int64_t alignment, int64_t* offset ) const
+	{
+		if ( _blocks.empty() )
+		{
+			*offset = 0;
+			return true;
+		}
+
+		int64_t head = _blocks.back().end;
+		int64_t tail = _blocks.front().beg;
+		if ( tail < head )
+		{
+			// free space is [head, capacity) and [0, tail)
+			int64_t o = alignedExpand( head, alignment );
+			if ( o + bytes <= _capacity )
+			{
+				*offset = o;
+				return true;
+			}
+			if ( bytes <= tail )
+			{
+				*offset = 0;
+				return true;
+			}
+			return false;
+		}
+
+		// wrapped. free space is [head, tail)
+		int64_t o = alignedExpand( head, alignment );
+		if ( o + bytes <= tail )
+		{
+			*offset = o;
+			return true;
+		}
+		return false;
+	}
+	struct Block
+	{
+		int64_t beg;
+		int64_t end;
+		uint64_t fenceValue; // 0 means not submitted yet
+		bool released;
+	};
+	Block* find( const Allocation& allocation )
+	{
+		for ( auto it = _blocks.rbegin(); it != _blocks.rend(); ++it )
+		{
+			if ( it->beg == allocation.offset )
+			{
+				return &*it;
+			}
+		}
+		DX_ASSERT( 0, "unknown allocation" );
+		return nullptr;
+	}
+
+	D3D12_HEAP_TYPE _heapType;
+	int64_t _capacity;
+	uint8_t* _ptr = nullptr;
+	DxPtr<ID3D12Resource> _resource;
+	TimelineFence* _fence;
+	uint64_t _lastRetired = 0;
+	std::mutex _mutex;
+	std::deque<Block> _blocks;
+};
+
+/*
+ CPU side offset allocator over [0, size). Best fit with coalescing of neighbouring free ranges.
+*/
+class RangeAllocator
+{
+public:
+	RangeAllocator( int64_t size ) : _size( size )
+	{
+		insertFree( 0, size );
+	}
+
+	// returns -1 when no free range is large enough.
+	int64_t allocate( int64_t bytes, int64_t alignment )
+	{
+		for ( auto it = _freeBySize.lower_bound( bytes ); it != _freeBySize.end(); ++it )
+		{
+			int64_t rangeBeg = it->second;
+			int64_t rangeEnd = rangeBeg + it->first;
+			int64_t o = alignedExpand( rangeBeg, alignment );
+			if ( rangeEnd < o + bytes )
+			{
+				continue;
+			}
+
+			eraseFree( rangeBeg );
+			if ( rangeBeg < o )
+			{
+				insertFree( rangeBeg, o - rangeBeg );
+			}
+			if ( o + bytes < rangeEnd )
+			{
+				insertFree( o + bytes, rangeEnd - ( o + bytes ) );
+			}
+			_used += bytes;
+			return o;
+		}
+		return -1;
+	}
+	void free( int64_t offset, int64_t bytes )
+	{
+		_used -= bytes;
+
+		int64_t beg = offset;
+		int64_t end = offset + bytes;
+
+		auto next = _freeByOffset.lower_bound( end );
+		if ( next != _freeByOffset.end() && next->first == end )
+		{
+			end += next->second;
+			eraseFree( next->first );
+		}
+		auto prev = _freeByOffset.lower_bound( beg );
+		if ( prev != _freeByOffset.begin() )
+		{
+			--prev;
+			if ( prev->first + prev->second == beg )
+			{
+				beg = prev->first;
+				eraseFree( prev->first );
+			}
+		}
+		insertFree( beg, end - beg );
+	}
+	int64_t size() const
+	{
+		return _size;
+	}
+	int64_t used() const
+	{
+		return _used;
+	}
+	int64_t largestFreeRange() const
+	{
+		return _freeBySize.empty() ? 0 : _freeBySize.rbegin()->first;
+	}
+	int freeRangeCount() const
+	{
+		return _freeByOffset.size();
+	}
+private:
+	void insertFree( int64_t offset, int64_t bytes )
+	{
+		_freeByOffset[offset] = bytes;
+		_freeBySize.insert( std::make_pair( bytes, offset ) );
+	}
+	void eraseFree( int64_t offset )
+	{
+		auto it = _freeByOffset.find( offset );
+		auto range = _freeBySize.equal_range( it->second );
+		for ( auto s = range.first; s != range.second; ++s )
+		{
+			if ( s->second == offset )
+			{
+				_freeBySize.erase( s );
+				break;
+			}
+		}
+		_freeByOffset.erase( it );
+	}
+
+	int64_t _size;
+	int64_t _used = 0;
+	std::map<int64_t, int64_t> _freeByOffset;
+	std::multimap<int64_t, int64_t> _freeBySize;
+};
+
+struct HeapAllocation
+{
+	ID3D12Heap* heap = nullptr;
+	int64_t offset = 0;
+	int64_t bytes = 0;
+};
+
+struct HeapStatistics
+{
+	int blockCount = 0;
+	int allocationCount = 0;
+	int64_t reservedBytes = 0;
+	int64_t allocatedBytes = 0;
+	int64_t largestFreeRange = 0;
+	int freeRangeCount = 0;
+
+	// 0 when all free memory is one range, close to 1 when it is scattered into small ranges.
+	double fragmentation() const
+	{
+		int64_t freeBytes = reservedBytes - allocatedBytes;
+		return freeBytes == 0 ? 0.0 : 1.0 - (double)largestFreeRange / freeBytes;
+	}
+};
+
+/*
+ Suballocates placed buffers from large ID3D12Heap blocks of one heap type.
+ Freed memory is reused after the GPU has passed the fence value given to free().
+*/
+class HeapAllocator
+{
+public:
+	HeapAllocator( const HeapAllocator& ) = delete;
+	void operator=( const HeapAllocator& ) = delete;
+
+	HeapAllocator( ID3D12Device* device, TimelineFence* fence, D3D12_HEAP_TYPE heapType, int64_t blockBytes )
+		: _fence( fence ), _heapType( heapType ), _blockBytes( blockBytes )
+	{
+		device->AddRef();
+		_device = DxPtr<ID3D12Device>( device );
+	}
+
+	DxPtr<ID3D12Resource> createBuffer( int64_t bytes, D3D12_RESOURCE_FLAGS flags, D3D12_RESOURCE_STATES initialState, HeapAllocation* allocation )
+	{
+		*allocation = allocate( bytes );
+
+		DxPtr<ID3D12Resource> resource;
+		HRESULT hr;
+		CD3DX12_RESOURCE_DESC resourceDesc = CD3DX12_RESOURCE_DESC::Buffer( bytes, flags );
+		hr = _device->CreatePlacedResource(
+			allocation->heap,
+			allocation->offset,
+			&resourceDesc,
+			initialState,
+			nullptr,
+			IID_PPV_ARGS( resource.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+		return resource;
+	}
+	HeapAllocation allocate( int64_t bytes )
+	{
+		bytes = alignedExpand( std::max( bytes, (int64_t)1 ), D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT );
+
+		std::lock_guard<std::mutex> lock( _mutex );
+		reclaim();
+
+		for ( Block& block : _blocks )
+		{
+			int64_t offset = block.ranges->allocate( bytes, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT );
+			if ( 0 <= offset )
+			{
+				return allocation( block, offset, bytes );
+			}
+		}
+
+		// large requests get a dedicated block that is released with the allocation.
+		Block& block = createBlock( std::max( bytes, _blockBytes ), _blockBytes < bytes );
+		int64_t offset = block.ranges->allocate( bytes, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT );
+		DX_ASSERT( offset == 0, "" );
+		return allocation( block, offset, bytes );
+	}
+
+	// the memory is reused once the GPU has passed fenceValue. the placed resource must be released before.
+	void free( const HeapAllocation& allocation, uint64_t fenceValue )
+	{
+		if ( allocation.heap == nullptr )
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock( _mutex );
+		_deferred.push_back( { allocation, fenceValue } );
+	}
+
+	// releases blocks that have no allocation
+	void trim()
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		reclaim();
+		_blocks.erase( std::remove_if( _blocks.begin(), _blocks.end(), []( const Block& b ) { return b.ranges->used() == 0; } ), _blocks.end() );
+	}
+	HeapStatistics statistics()
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		reclaim();
+
+		HeapStatistics stat;
+		stat.allocationCount = _allocationCount;
+		for ( const Block& block : _blocks )
+		{
+			stat.blockCount++;
+			stat.reservedBytes += block.ranges->size();
+			stat.allocatedBytes += block.ranges->used();
+			stat.largestFreeRange = std::max( stat.largestFreeRange, block.ranges->largestFreeRange() );
+			stat.freeRangeCount += block.ranges->freeRangeCount();
+		}
+		return stat;
+	}
+	D3D12_HEAP_TYPE heapType() const
+	{
+		return _heapType;
+	}
+private:
+	struct Block
+	{
+		DxPtr<ID3D12Heap> heap;
+		std::shared_ptr<RangeAllocator> ranges;
+		bool dedicated;
+	};
+	Block& createBlock( int64_t bytes, bool dedicated )
+	{
+		D3D12_HEAP_DESC desc = {};
+		desc.SizeInBytes = bytes;
+		desc.Properties = CD3DX12_HEAP_PROPERTIES( _heapType );
+		desc.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+		desc.Flags = D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS;
+
+		Block block;
+		HRESULT hr;
+		hr = _device->CreateHeap( &desc, IID_PPV_ARGS( block.heap.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+		block.ranges = std::shared_ptr<RangeAllocator>( new RangeAllocator( bytes ) );
+		block.dedicated = dedicated;
+		_blocks.push_back( block );
+		return _blocks.back();
+	}
+	HeapAllocation allocation( Block& block, int64_t offset, int64_t bytes )
+	{
+		_allocationCount++;
+
+		HeapAllocation a;
+		a.heap = block.heap.get();
+		a.offset = offset;
+		a.bytes = bytes;
+		return a;
+	}
+	void reclaim()
+	{
+		while ( !_deferred.empty() && _fence->isComplete( _deferred.front().fenceValue ) )
+		{
+			HeapAllocation a = _deferred.front().allocation;
+			_deferred.pop_front();
+			_allocationCount--;
+
+			for ( auto it = _blocks.begin(); it != _blocks.end(); ++it )
+			{
+				if ( it->heap.get() != a.heap )
+				{
+					continue;
+				}
+				it->ranges->free( a.offset, a.bytes );
+				if ( it->dedicated )
+				{
+					_blocks.erase( it );
+				}
+				break;
+			}
+		}
+	}
+
+	struct Deferred
+	{
+		HeapAllocation allocation;
+		uint64_t fenceValue;
+	};
+
+	DxPtr<ID3D12Device> _device;
+	TimelineFence* _fence;
+	D3D12_HEAP_TYPE _heapType;
+	int64_t _blockBytes;
+	int _allocationCount = 0;
+	std::mutex _mutex;
+	std::deque<Block> _blocks;
+	std::deque<Deferred> _deferred;
+};
+
+struct BufferCacheStatistics
+{
+	int64_t hits = 0;
+	int64_t misses = 0;
+	int cachedCount = 0;
+	int64_t cachedBytes = 0;
+};
+
+/*
+ Keeps released DEFAULT heap buffers in free lists bucketed by size class.
+ A cached buffer is handed out again only after the GPU has passed the fence value of its last use.
+*/
+class BufferCache
+{
+public:
+	struct Entry
+	{
+		DxPtr<ID3D12Resource> resource;
+		HeapAllocation allocation;
+		D3D12_RESOURCE_STATES state = D3D12_RESOURCE_STATE_COMMON;
+		int64_t bytes = 0;
+		uint64_t fenceValue = 0;
+		uint64_t released = 0; // order of release(). the front of a bucket is its oldest
+	};
+
+	BufferCache( const BufferCache& ) = delete;
+	void operator=( const BufferCache& ) = delete;
+
+	BufferCache( HeapAllocator* heap, TimelineFence* fence ) : _heap( heap ), _fence( fence )
+	{
+	}
+	~BufferCache()
+	{
+		trim( 0 );
+	}
+
+	// at most 25% larger than bytes. buffers of the same class are interchangeable.
+	static int64_t sizeClass( int64_t bytes )
+	{
+		int64_t p = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+		while ( p * 2 <= bytes )
+		{
+			p *= 2;
+		}
+		return alignedExpand( bytes, std::max( p / 4, (int64_t)D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT ) );
+	}
+
+	// returns false on a miss. entry->bytes is the size class of the request.
+	bool acquire( int64_t bytes, Entry* entry )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		std::deque<Entry>& bucket = _buckets[sizeClass( bytes )];
+		for ( auto it = bucket.begin(); it != bucket.end(); ++it )
+		{
+			if ( _fence->isComplete( it->fenceValue ) )
+			{
+				*entry = *it;
+				bucket.erase( it );
+				_stat.hits++;
+				_stat.cachedCount--;
+				_stat.cachedBytes -= entry->bytes;
+				return true;
+			}
+		}
+		_stat.misses++;
+		return false;
+	}
+	void release( const Entry& entry )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_buckets[entry.bytes].push_back( entry );
+		_buckets[entry.bytes].back().released = ++_released;
+		_stat.cachedCount++;
+		_stat.cachedBytes += entry.bytes;
+	}
+
+	// gives cached buffers back to the heap allocator, oldest first, until at most maxCachedBytes remain.
+	void trim( int64_t maxCachedBytes )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		while ( maxCachedBytes < _stat.cachedBytes && 0 < _stat.cachedCount )
+		{
+			std::deque<Entry>* oldest = nullptr;
+			for ( auto& bucket : _buckets )
+			{
+				if ( !bucket.second.empty() && ( !oldest || bucket.second.front().released < oldest->front().released ) )
+				{
+					oldest = &bucket.second;
+				}
+			}
+			Entry& e = oldest->front();
+			e.resource = DxPtr<ID3D12Resource>();
+			_heap->free( e.allocation, e.fenceValue );
+			_stat.cachedCount--;
+			_stat.cachedBytes -= e.bytes;
+			oldest->pop_front();
+		}
+	}
+	BufferCacheStatistics statistics()
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		return _stat;
+	}
+private:
+	HeapAllocator* _heap;
+	TimelineFence* _fence;
+	std::mutex _mutex;
+	std::map<int64_t, std::deque<Entry>> _buckets;
+	uint64_t _released = 0;
+	BufferCacheStatistics _stat;
+};
+
+/*
+ Non-shader-visible CBV/SRV/UAV descriptors. Resources create their views here once, and argument tables are assembled from them with CopyDescriptors.
+ Grows by pages of pageCount descriptors.
+*/
+class DescriptorPool
+{
+public:
+	DescriptorPool( const DescriptorPool& ) = delete;
+	void operator=( const DescriptorPool& ) = delete;
+
+	DescriptorPool( ID3D12Device* device, int64_t pageCount ) : _pageCount( pageCount )
+	{
+		device->AddRef();
+		_device = DxPtr<ID3D12Device>( device );
+		_increment = device->GetDescriptorHandleIncrementSize( D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV );
+	}
+	// a freed handle is handed out again, so every allocation gets a generation of its own to tell it apart from the previous view
+	D3D12_CPU_DESCRIPTOR_HANDLE allocate( uint64_t* generation = nullptr )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		if ( generation )
+		{
+			*generation = ++_generation;
+		}
+		if ( _free.empty() )
+		{
+			HRESULT hr;
+			D3D12_DESCRIPTOR_HEAP_DESC desc = {};
+			desc.NumDescriptors = (UINT)_pageCount;
+			desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+			desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
+			DxPtr<ID3D12DescriptorHeap> page;
+			hr = _device->CreateDescriptorHeap( &desc, IID_PPV_ARGS( page.getAddressOf() ) );
+			DX_ASSERT( hr == S_OK, "" );
+
+			D3D12_CPU_DESCRIPTOR_HANDLE h = page->GetCPUDescriptorHandleForHeapStart();
+			for ( int64_t i = _pageCount - 1; 0 <= i; --i )
+			{
+				D3D12_CPU_DESCRIPTOR_HANDLE d = { h.ptr + _increment * i };
+				_free.push_back( d );
+			}
+			_pages.push_back( page );
+		}
+		D3D12_CPU_DESCRIPTOR_HANDLE h = _free.back();
+		_free.pop_back();
+		return h;
+	}
+	void free( D3D12_CPU_DESCRIPTOR_HANDLE h )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_free.push_back( h );
+	}
+private:
+	DxPtr<ID3D12Device> _device;
+	int64_t _pageCount;
+	uint32_t _increment = 0;
+	uint64_t _generation = 0;
+	std::mutex _mutex;
+	std::vector<DxPtr<ID3D12DescriptorHeap>> _pages;
+	std::vector<D3D12_CPU_DESCRIPTOR_HANDLE> _free;
+};
+
+struct DescriptorTable
+{
+	int64_t index = -1;
+	D3D12_CPU_DESCRIPTOR_HANDLE cpu = {};
+	D3D12_GPU_DESCRIPTOR_HANDLE gpu = {};
+};
+
+/*
+ The one shader-visible CBV/SRV/UAV heap of a device, so a context binds it once.
+ [0, persistentCount) is suballocated by RangeAllocator for tables that live as long as their owner.
+ The rest is a ring of transient tables, which are reused once the fence has passed the submission that referenced them.
+*/
+class DescriptorHeap
+{
+public:
+	DescriptorHeap( const DescriptorHeap& ) = delete;
+	void operator=( const DescriptorHeap& ) = delete;
+
+	DescriptorHeap( ID3D12Device* device, TimelineFence* fence, int64_t persistentCount, int64_t transientCount )
+		: _fence( fence ), _persistent( persistentCount ), _transientBeg( persistentCount ), _transientCount( transientCount )
+	{
+		HRESULT hr;
+		D3D12_DESCRIPTOR_HEAP_DESC desc = {};
+		desc.NumDescriptors = (UINT)( persistentCount + transientCount );
+		desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+		desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+		hr = device->CreateDescriptorHeap( &desc, IID_PPV_ARGS( _heap.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+		_heap->SetName( L"DescriptorHeap" );
+
+		_increment = device->GetDescriptorHandleIncrementSize( D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV );
+		_cpuStart = _heap->GetCPUDescriptorHandleForHeapStart();
+		_gpuStart = _heap->GetGPUDescriptorHandleForHeapStart();
+	}
+	ID3D12DescriptorHeap* heap()
+	{
+		return _heap.get();
+	}
+	uint32_t increment() const
+	{
+		return _increment;
+	}
+	DescriptorTable table( int64_t index ) const
+	{
+		DescriptorTable t;
+		t.index = index;
+		t.cpu.ptr = _cpuStart.ptr + _increment * index;
+		t.gpu.ptr = _gpuStart.ptr + _increment * index;
+		return t;
+	}
+
+	DescriptorTable allocate( int64_t count )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		reclaim();
+		int64_t index = _persistent.allocate( std::max( count, (int64_t)1 ), 1 );
+		DX_ASSERT( 0 <= index, "the persistent region of the descriptor heap is full" );
+		return table( index );
+	}
+	// fenceValue is the last submission that referenced the table
+	void free( const DescriptorTable& t, int64_t count, uint64_t fenceValue )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_deferred.push_back( { t.index, std::max( count, (int64_t)1 ), fenceValue } );
+	}
+
+	// valid until the submission of the context has been executed. blocks only while older submissions still use the ring.
+	DescriptorTable allocateTransient( CommandContext& context, int64_t count )
+	{
+		count = std::max( count, (int64_t)1 );
+		DX_ASSERT( count <= _transientCount, "the table is larger than the transient ring" );
+
+		std::unique_lock<std::mutex> lock( _mutex );
+		for ( ;; )
+		{
+			while ( !_transients.empty() && isRetired( _transients.front() ) )
+			{
+				_transients.pop_front();
+			}
+
+			int64_t offset;
+			if ( findTransientSpace( count, &offset ) )
+			{
+				_transients.emplace_back();
+				Transient& t = _transients.back();
+				t.beg = offset;
+				t.end = offset + count;
+				context.use( &t.use );
+				return table( _transientBeg + offset );
+			}
+
+			// the ring is transientCount descriptors (64K for DeviceObject) shared by every context. waiting cannot free the part an open context records into.
+			const Transient& oldest = _transients.front();
+			DX_ASSERT( !oldest.use.recording, "the transient descriptor ring is full of tables of an open context. submit long contexts in parts or raise transientCount" );
+			uint64_t lastUse = oldest.use.lastUse;
+
+			// other threads keep allocating and freeing while this one waits
+			lock.unlock();
+			_fence->waitFor( lastUse );
+			lock.lock();
+		}
+	}
+private:
+	struct Transient
+	{
+		int64_t beg;
+		int64_t end;
+		ResourceState use;
+	};
+	struct Deferred
+	{
+		int64_t index;
+		int64_t count;
+		uint64_t fenceValue;
+	};
+	bool isRetired( const Transient& t )
+	{
+		return !t.use.recording && _fence->isComplete( t.use.lastUse );
+	}
+	bool findTransientSpace( int64_t count, int64_t* offset ) const
+	{
+		if ( _transients.empty() )
+		{
+			*offset = 0;
+			return true;
+		}
+
+		int64_t head = _transients.back().end;
+		int64_t tail = _transients.front().beg;
+		if ( tail < head )
+		{
+			// free space is [head, count) and [0, tail)
+			if ( head + count <= _transientCount )
+			{
+				*offset = head;
+				return true;
+			}
+			if ( count <= tail )
+			{
+				*offset = 0;
+				return true;
+			}
+			return false;
+		}
+
+		// wrapped. free space is [head, tail)
+		if ( head + count <= tail )
+		{
+			*offset = head;
+			return true;
+		}
+		return false;
+	}
+	void reclaim()
+	{
+		while ( !_deferred.empty() && _fence->isComplete( _deferred.front().fenceValue ) )
+		{
+			_persistent.free( _deferred.front().index, _deferred.front().count );
+			_deferred.pop_front();
+		}
+	}
+
+	DxPtr<ID3D12DescriptorHeap> _heap;
+	TimelineFence* _fence;
+	uint32_t _increment = 0;
+	D3D12_CPU_DESCRIPTOR_HANDLE _cpuStart = {};
+	D3D12_GPU_DESCRIPTOR_HANDLE _gpuStart = {};
+	std::mutex _mutex;
+
+	RangeAllocator _persistent;
+	std::deque<Deferred> _deferred;
+
+	int64_t _transientBeg;
+	int64_t _transientCount;
+	std::deque<Transient> _transients;
+};
+
+/*
+ Constants of one submission. A pointer bumps through an upload page, and a full page is recycled when the submissions that used it have been executed.
+*/
+class ConstantAllocator
+{
+public:
+	ConstantAllocator( const ConstantAllocator& ) = delete;
+	void operator=( const ConstantAllocator& ) = delete;
+
+	ConstantAllocator( ID3D12Device* device, TimelineFence* fence, int64_t pageBytes ) : _device( device ), _fence( fence ), _pageBytes( pageBytes )
+	{
+	}
+	~ConstantAllocator()
+	{
+		for( Page& page : _pages )
+		{
+			D3D12_RANGE range = { 0, (SIZE_T)_pageBytes };
+			page.resource->Unmap( 0, &range );
+		}
+	}
+
+	// copies the data and returns its address. it is valid until the submission of the context has been executed.
+	D3D12_GPU_VIRTUAL_ADDRESS push( CommandContext& context, const void* data, int64_t bytes )
+	{
+		int64_t aligned = alignedExpand( std::max( bytes, (int64_t)1 ), D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT );
+		DX_ASSERT( aligned <= _pageBytes, "the constants are larger than a page" );
+
+		std::lock_guard<std::mutex> lock( _mutex );
+		if( !_current || _pageBytes < _current->head + aligned )
+		{
+			_current = nextPage();
+		}
+		int64_t offset = _current->head;
+		_current->head += aligned;
+		memcpy( _current->ptr + offset, data, bytes );
+		context.use( &_current->use );
+		return _current->resource->GetGPUVirtualAddress() + offset;
+	}
+private:
+	struct Page
+	{
+		DxPtr<ID3D12Resource> resource;
+		uint8_t* ptr = nullptr;
+		int64_t head = 0;
+		ResourceState use;
+	};
+	Page* nextPage()
+	{
+		for( Page& page : _pages )
+		{
+			if( &page != _current && !page.use.recording && _fence->isComplete( page.use.lastUse ) )
+			{
+				page.head = 0;
+				return &page;
+			}
+		}
+
+		_pages.emplace_back();
+		Page& page = _pages.back();
+		HRESULT hr;
+		CD3DX12_HEAP_PROPERTIES heapProperties( D3D12_HEAP_TYPE_UPLOAD );
+		CD3DX12_RESOURCE_DESC resourceDesc = CD3DX12_RESOURCE_DESC::Buffer( _pageBytes );
+		hr = _device->CreateCommittedResource(
+			&heapProperties,
+			D3D12_HEAP_FLAG_NONE,
+			&resourceDesc,
+			D3D12_RESOURCE_STATE_GENERIC_READ,
+			nullptr,
+			IID_PPV_ARGS( page.resource.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+		page.resource->SetName( L"ConstantPage" );
+
+		// no read
+		D3D12_RANGE range = {};
+		void* p;
+		hr = page.resource->Map( 0, &range, &p );
+		DX_ASSERT( hr == S_OK, "" );
+		page.ptr = (uint8_t*)p;
+		return &page;
+	}
+
+	ID3D12Device* _device;
+	TimelineFence* _fence;
+	int64_t _pageBytes;
+	std::mutex _mutex;
+	std::deque<Page> _pages;
+	Page* _current = nullptr;
+};
+
+struct PipelineLibraryStatistics
+{
+	int64_t hits = 0;
+	int64_t misses = 0;
+};
+
+/*
+ Pipeline states persisted across processes with ID3D12PipelineLibrary, so that the driver compiles DXIL to ISA only once.
+ The file is memory mapped while the library is alive and written back on destruction when new pipelines were stored.
+ It is tagged with the adapter LUID and the driver version, and it starts empty when either differs.
+*/
+class PipelineLibrary
+{
+public:
+	PipelineLibrary( const PipelineLibrary& ) = delete;
+	void operator=( const PipelineLibrary& ) = delete;
+
+	PipelineLibrary( ID3D12Device* device, LUID adapterLuid, uint64_t driverVersion, const std::string& file )
+		: _file( file ), _adapterLuid( adapterLuid ), _driverVersion( driverVersion )
+	{
+		HRESULT hr;
+		hr = device->QueryInterface( IID_PPV_ARGS( _device.getAddressOf() ) );
+		if( hr != S_OK )
+		{
+			return;
+		}
+		D3D12_FEATURE_DATA_SHADER_CACHE shaderCache = {};
+		hr = device->CheckFeatureSupport( D3D12_FEATURE_SHADER_CACHE, &shaderCache, sizeof( shaderCache ) );
+		if( hr != S_OK || ( shaderCache.SupportFlags & D3D12_SHADER_CACHE_SUPPORT_LIBRARY ) == 0 )
+		{
+			return;
+		}
+
+		const void* blob = nullptr;
+		SIZE_T blobBytes = 0;
+		if( _mapped.open( _file ) )
+		{
+			const Header* header = (const Header*)_mapped.data();
+			if( sizeof( Header ) <= _mapped.size() &&
+				header->magic == Magic &&
+				header->version == Version &&
+				header->adapterLuid.LowPart == _adapterLuid.LowPart &&
+				header->adapterLuid.HighPart == _adapterLuid.HighPart &&
+				header->driverVersion == _driverVersion &&
+				header->bytes <= _mapped.size() - sizeof( Header ) )
+			{
+				blob = (const uint8_t*)_mapped.data() + sizeof( Header );
+				blobBytes = header->bytes;
+			}
+		}
+
+		hr = _device->CreatePipelineLibrary( blob, blobBytes, IID_PPV_ARGS( _library.getAddressOf() ) );
+		if( hr != S_OK && blob )
+		{
+			// D3D12_ERROR_DRIVER_VERSION_MISMATCH or a corrupted file
+			_mapped.close();
+			hr = _device->CreatePipelineLibrary( nullptr, 0, IID_PPV_ARGS( _library.getAddressOf() ) );
+		}
+		DX_ASSERT( hr == S_OK, "" );
+	}
+	~PipelineLibrary()
+	{
+		std::vector<uint8_t> serialized;
+		if( _library && _stored )
+		{
+			serialized.resize( _library->GetSerializedSize() );
+			HRESULT hr = _library->Serialize( serialized.data(), serialized.size() );
+			DX_ASSERT( hr == S_OK, "" );
+		}
+
+		// the file can't be replaced while it is mapped.
+		_library = DxPtr<ID3D12PipelineLibrary>();
+		_mapped.close();
+
+		if( !serialized.empty() )
+		{
+			write( serialized );
+		}
+	}
+
+	// the library is unavailable when the driver doesn't support it. pipelines are created directly then.
+	bool isAvailable() const
+	{
+		return _library.get() != nullptr;
+	}
+
+	/*
+	 The name is a hash of the bytecode and the serialized root signature, the same as the description the pipeline is loaded with.
+	*/
+	DxPtr<ID3D12PipelineState> computePipeline( const D3D12_COMPUTE_PIPELINE_STATE_DESC& desc, const void* rootSignature, size_t rootSignatureBytes )
+	{
+		HRESULT hr;
+		DxPtr<ID3D12PipelineState> pipeline;
+		if( !_library )
+		{
+			hr = _device->CreateComputePipelineState( &desc, IID_PPV_ARGS( pipeline.getAddressOf() ) );
+			DX_ASSERT( hr == S_OK, "" );
+			return pipeline;
+		}
+
+		ByteWriter key;
+		key.write( desc.CS.pShaderBytecode, desc.CS.BytecodeLength );
+		key.write( rootSignature, rootSignatureBytes );
+		std::string hash = murmurHash3_128( key.bytes().data(), key.bytes().size(), 0 ).toString();
+		std::wstring name( hash.begin(), hash.end() );
+
+		hr = _library->LoadComputePipeline( name.c_str(), &desc, IID_PPV_ARGS( pipeline.getAddressOf() ) );
+		if( hr == S_OK )
+		{
+			_hits++;
+			return pipeline;
+		}
+
+		_misses++;
+		hr = _device->CreateComputePipelineState( &desc, IID_PPV_ARGS( pipeline.getAddressOf() ) );
+		DX_ASSERT( hr == S_OK, "" );
+
+		// E_INVALIDARG when another thread has stored the same name in the meantime.
+		if( _library->StorePipeline( name.c_str(), pipeline.get() ) == S_OK )
+		{
+			_stored = true;
+		}
+		return pipeline;
+	}
+
+	PipelineLibraryStatistics statistics() const
+	{
+		PipelineLibraryStatistics s;
+		s.hits = _hits;
+		s.misses = _misses;
+		return s;
+	}
+private:
+	enum
+	{
+		Magic = 0x4c505a45, // "EZPL"
+		Version = 1,
+	};
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		LUID adapterLuid;
+		uint64_t driverVersion;
+		uint64_t bytes;
+	};
+
+	void write( const std::vector<uint8_t>& serialized )
+	{
+		Header header = {};
+		header.magic = Magic;
+		header.version = Version;
+		header.adapterLuid = _adapterLuid;
+		header.driverVersion = _driverVersion;
+		header.bytes = serialized.size();
+
+		std::error_code ec;
+		std::filesystem::path file( _file );
+		std::filesystem::create_directories( file.parent_path(), ec );
+		std::filesystem::path tmpFile = file;
+		tmpFile += "." + std::to_string( GetCurrentProcessId() ) + ".tmp";
+
+		bool written;
+		{
+			std::ofstream ofs( tmpFile, std::ios::binary );
+			ofs.write( (const char*)&header, sizeof( header ) );
+			ofs.write( (const char*)serialized.data(), serialized.size() );
+			ofs.close();
+			written = !ofs.fail();
+		}
+
+		// fails when another process still has the file mapped. its pipelines are stored by the next run.
+		if( written )
+		{
+			std::filesystem::rename( tmpFile, file, ec );
+		}
+		if( !written || ec )
+		{
+			std::filesystem::remove( tmpFile, ec );
+		}
+	}
+
+	std::string _file;
+	LUID _adapterLuid;
+	uint64_t _driverVersion;
+	DxPtr<ID3D12Device1> _device;
+	DxPtr<ID3D12PipelineLibrary> _library;
+	MappedFile _mapped;
+	std::atomic<bool> _stored { false };
+	std::atomic<int64_t> _hits { 0 };
+	std::atomic<int64_t> _misses { 0 };
+};
+
+class DeviceObject
+{
+public:
+	DeviceObject( const DeviceObject& ) = delete;
+	void operator=( const DeviceObject& ) = delete;
+
+	DeviceObject( IDXGIAdapter* adapter )
+	{
+		HRESULT hr;
+
+		DXGI_ADAPTER_DESC d;
+		hr = adapter->GetDesc( &d );
+		DX_ASSERT( hr == S_OK, "" );
+
+		_deviceName = d.Description;
+		_adapterLuid = d.AdapterLuid;
+
+		// the user mode driver version
+		LARGE_INTEGER driverVersion = {};
+		if( adapter->CheckInterfaceSupport( __uuidof( IDXGIDevice ), &driverVersion ) == S_OK )
+		{
+			_driverVersion = driverVersion.QuadPart;
+		}
+
+		struct DeviceIID
+		{
+			IID iid;
+			const char* type;
+		};
+#define DEVICE_VER( type )      \
+	{                           \
+		__uuidof( type ), #type \
+	}
+		const DeviceIID deviceIIDs[] = {
+			DEVICE_VER( ID3D12Device8 ),
+			DEVICE_VER( ID3D12Device7 ),
+			DEVICE_VER( ID3D12Device6 ),
+			DEVICE_VER( ID3D12Device5 ),
+			DEVICE_VER( ID3D12Device4 ),
+			DEVICE_VER( ID3D12Device3 ),
+			DEVICE_VER( ID3D12Device2 ),
+			DEVICE_VER( ID3D12Device1 ),
+		};
+#undef DEVICE_VER
+
+		for ( auto deviceIID : deviceIIDs )
+		{
+			hr = D3D12CreateDevice( adapter, D3D_FEATURE_LEVEL_12_0, deviceIID.iid, (void**)_device.getAddressOf() );
+			if ( hr == S_OK )
+			{
+				_deviceIIDType = deviceIID.type;
+				break;
+			}
+		}
+		DX_ASSERT( hr == S_OK, "" );
+
+		D3D12_FEATURE_DATA_SHADER_MODEL shaderModelFeature = {};
+		shaderModelFeature.HighestShaderModel = D3D_SHADER_MODEL_6_6;
+		hr = _device->CheckFeatureSupport( D3D12_FEATURE_SHADER_MODEL, &shaderModelFeature, sizeof( shaderModelFeature ) );
+		DX_ASSERT( hr == S_OK, "" );
+
+		std::map<D3D_SHADER_MODEL, std::string> sm_to_s =
+			{
+				{ D3D_SHADER_MODEL_5_1, "D3D_SHADER_MODEL_5_1" },
+				{ D3D_SHADER_MODEL_6_0, "D3D_SHADER_MODEL_6_0" },
+				{ D3D_SHADER_MODEL_6_1, "D3D_SHADER_MODEL_6_1" },
+				{ D3D_SHADER_MODEL_6_2, "D3D_SHADER_MODEL_6_2" },
+				{ D3D_SHADER_MODEL_6_3, "D3D_SHADER_MODEL_6_3" },
+				{ D3D_SHADER_MODEL_6_4, "D3D_SHADER_MODEL_6_4" },
+				{ D3D_SHADER_MODEL_6_5, "D3D_SHADER_MODEL_6_5" },
+				{ D3D_SHADER_MODEL_6_6, "D3D_SHADER_MODEL_6_6" },
+			};
+		_highestShaderModel = sm_to_s[shaderModelFeature.HighestShaderModel];
+		_shaderModel = shaderModelFeature.HighestShaderModel;
+
+		D3D12_FEATURE_DATA_D3D12_OPTIONS1 option1 = {};
+		hr = _device->CheckFeatureSupport( D3D12_FEATURE_D3D12_OPTIONS1, &option1, sizeof( option1 ) );
+		DX_ASSERT( hr == S_OK, "" );
+		_waveLaneCount = option1.WaveLaneCountMin;
+		_waveLaneCountMax = option1.WaveLaneCountMax;
+		_totalLaneCount = option1.TotalLaneCount;
+
+		D3D12_FEATURE_DATA_D3D12_OPTIONS4 option4 = {};
+		if( _device->CheckFeatureSupport( D3D12_FEATURE_D3D12_OPTIONS4, &option4, sizeof( option4 ) ) == S_OK )
+		{
+			_native16BitShaderOps = option4.Native16BitShaderOpsSupported;
+		}
+
+		D3D12_COMMAND_QUEUE_DESC commandQueueDesk = {};
+		commandQueueDesk.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+		commandQueueDesk.Priority = D3D12_COMMAND_QUEUE_PRIORITY_HIGH;
+		commandQueueDesk.Flags = D3D12_COMMAND_QUEUE_FLAG_DISABLE_GPU_TIMEOUT;
+		commandQueueDesk.NodeMask = 0;
+		hr = _device->CreateCommandQueue(&commandQueueDesk, IID_PPV_ARGS(_queue.getAddressOf()));
 		DX_ASSERT(hr == S_OK, "");
+
+		_fence = std::unique_ptr<TimelineFence>( new TimelineFence( _device.get() ) );
+		_commandPool = std::unique_ptr<CommandPool>( new CommandPool( _device.get(), _fence.get() ) );
+		_descriptorHeap = std::unique_ptr<DescriptorHeap>( new DescriptorHeap( _device.get(), _fence.get(), 64 * 1024, 64 * 1024 ) );
+		_descriptorPool = std::unique_ptr<DescriptorPool>( new DescriptorPool( _device.get(), 4096 ) );
+		_constantAllocator = std::unique_ptr<ConstantAllocator>( new ConstantAllocator( _device.get(), _fence.get(), 64 * 1024 ) );
+		_defaultHeap = std::unique_ptr<HeapAllocator>( new HeapAllocator( _device.get(), _fence.get(), D3D12_HEAP_TYPE_DEFAULT, 256 * 1024 * 1024 ) );
+		_uploadHeap = std::unique_ptr<HeapAllocator>( new HeapAllocator( _device.get(), _fence.get(), D3D12_HEAP_TYPE_UPLOAD, 32 * 1024 * 1024 ) );
+		_readbackHeap = std::unique_ptr<HeapAllocator>( new HeapAllocator( _device.get(), _fence.get(), D3D12_HEAP_TYPE_READBACK, 32 * 1024 * 1024 ) );
+		_uploadRing = std::unique_ptr<StagingRing>( new StagingRing( _device.get(), _fence.get(), D3D12_HEAP_TYPE_UPLOAD, 64 * 1024 * 1024 ) );
+		_readbackRing = std::unique_ptr<StagingRing>( new StagingRing( _device.get(), _fence.get(), D3D12_HEAP_TYPE_READBACK, 16 * 1024 * 1024 ) );
+
+		DxPtr<IDXGIFactory4> pDxgiFactory;
+		hr = CreateDXGIFactory1( __uuidof( IDXGIFactory1 ), (void**)pDxgiFactory.getAddressOf() );
+		DX_ASSERT( hr == S_OK, "" );
+
+		DXGI_SWAP_CHAIN_DESC1 swapChainDesc = {};
+		swapChainDesc.BufferCount = 2;
+		swapChainDesc.Width = 64;
+		swapChainDesc.Height = 64;
+		swapChainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+		swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+		swapChainDesc.SampleDesc.Count = 1;
+
+		// Create the swap chain
+		hr = pDxgiFactory->CreateSwapChainForComposition( _queue.get(), &swapChainDesc, nullptr, _swapchain.getAddressOf() );
+		DX_ASSERT( hr == S_OK, "" );
+	}
+	~DeviceObject()
+	{
+		_fence->waitForIdle();
+	}
+	ID3D12Device* device()
+	{
+		return _device.get();
+	}
+	void present()
+	{
+		HRESULT hr;
+		hr = _swapchain->Present( 1, 0 );
+		DX_ASSERT( hr == S_OK, "" );
+	}
+	std::wstring deviceName() const
+	{
+		return _deviceName;
+	}
+	int waveLaneCount() const
+	{
+		return _waveLaneCount;
+	}
+	// [WaveSize()] of cs_6_6 has to be in [waveLaneCount(), waveLaneCountMax()]
+	int waveLaneCountMax() const
+	{
+		return _waveLaneCountMax;
+	}
+	bool native16BitShaderOps() const
+	{
+		return _native16BitShaderOps;
+	}
+	// the highest compute target, e.g. "cs_6_6"
+	std::string computeTarget() const
+	{
+		int major = ( _shaderModel >> 4 ) & 0xf;
+		int minor = _shaderModel & 0xf;
+		return "cs_" + std::to_string( major ) + "_" + std::to_string( minor );
+	}
+	int totalLaneCount() const
+	{
+		return _totalLaneCount;
+	}
+	ID3D12CommandQueue* queue()
+	{
+		return _queue.get();
+	}
+	TimelineFence* fence()
+	{
+		return _fence.get();
+	}
+	DescriptorHeap* descriptorHeap()
+	{
+		return _descriptorHeap.get();
+	}
+	DescriptorPool* descriptorPool()
+	{
+		return _descriptorPool.get();
+	}
+	ConstantAllocator* constantAllocator()
+	{
+		return _constantAllocator.get();
+	}
+	StagingRing* uploadRing()
+	{
+		return _uploadRing.get();
+	}
+	StagingRing* readbackRing()
+	{
+		return _readbackRing.get();
+	}
+	// opt-in. BufferResource is recycled through the cache after this call.
+	void enableBufferCache()
+	{
+		if( !_bufferCache )
+		{
+			_bufferCache = std::unique_ptr<BufferCache>( new BufferCache( _defaultHeap.get(), _fence.get() ) );
+		}
+	}
+	// nullptr unless enableBufferCache() was called
+	BufferCache* bufferCache()
+	{
+		return _bufferCache.get();
+	}
+	// opt-in. Shader loads its pipeline from the file, which is updated when the device is destroyed.
+	void enablePipelineLibrary( const std::string& file )
+	{
+		if( !_pipelineLibrary )
+		{
+			_pipelineLibrary = std::unique_ptr<PipelineLibrary>( new PipelineLibrary( _device.get(), _adapterLuid, _driverVersion, file ) );
+		}
+	}
+	// nullptr unless enablePipelineLibrary() was called
+	PipelineLibrary* pipelineLibrary()
+	{
+		return _pipelineLibrary.get();
+	}
+	// opt-in. every BufferResource created afterwards gets a stable index into the shader-visible heap, see ArgumentHeap::Bindless().
+	void enableBindless()
+	{
+		DX_ASSERT( D3D_SHADER_MODEL_6_6 <= _shaderModel, "ResourceDescriptorHeap needs shader model 6.6" );
+		_bindless = true;
+	}
+	bool bindless() const
+	{
+		return _bindless;
+	}
+	HeapAllocator* heapAllocator( D3D12_HEAP_TYPE heapType )
+	{
+		switch( heapType )
+		{
+		case D3D12_HEAP_TYPE_DEFAULT:
+			return _defaultHeap.get();
+		case D3D12_HEAP_TYPE_UPLOAD:
+			return _uploadHeap.get();
+		case D3D12_HEAP_TYPE_READBACK:
+			return _readbackHeap.get();
+		default:
+			DX_ASSERT( 0, "" );
+		}
+		return nullptr;
+	}
+
+	CommandPool* commandPool()
+	{
+		return _commandPool.get();
 	}
-	void wait()
+
+	// opens a recording context. commands are executed by CommandContext::submit().
+	CommandContext begin()
+	{
+		CommandContext context( _commandPool.get(), _fence.get(), _queue.get() );
+		context.setDescriptorHeap( _descriptorHeap->heap() );
+		return context;
+	}
+
+	// returns the fence value signaled after the command. it doesn't wait for previous submissions.
+	uint64_t executeCommand(std::function<void(ID3D12GraphicsCommandList* commandList)> f)
 	{
-		HANDLE e = CreateEvent(nullptr, false, false, nullptr);
-		_fence->SetEventOnCompletion(1, e);
-		WaitForSingleObject(e, INFINITE);
-		CloseHandle(e);
+		CommandContext context = begin();
+		f( context.list() );
+		return context.submit();
 	}
 private:
-	DxPtr<ID3D12Fence> _fence;
+	std::string _deviceIIDType;
+	std::wstring _deviceName;
+	LUID _adapterLuid = {};
+	uint64_t _driverVersion = 0;
+	std::string _highestShaderModel;
+	D3D_SHADER_MODEL _shaderModel = D3D_SHADER_MODEL_6_0;
+	int _waveLaneCount = 0;
+	int _waveLaneCountMax = 0;
+	bool _native16BitShaderOps = false;
+	bool _bindless = false;
+	int _totalLaneCount = 0;
+	DxPtr<ID3D12Device> _device;
+	DxPtr<ID3D12CommandQueue> _queue;
+	DxPtr<IDXGISwapChain1> _swapchain;
+	std::unique_ptr<TimelineFence> _fence;
+	std::unique_ptr<CommandPool> _commandPool;
+	std::unique_ptr<DescriptorHeap> _descriptorHeap;
+	std::unique_ptr<DescriptorPool> _descriptorPool;
+	std::unique_ptr<ConstantAllocator> _constantAllocator;
+	std::unique_ptr<HeapAllocator> _defaultHeap;
+	std::unique_ptr<HeapAllocator> _uploadHeap;
+	std::unique_ptr<HeapAllocator> _readbackHeap;
+	std::unique_ptr<BufferCache> _bufferCache;
+	std::unique_ptr<StagingRing> _uploadRing;
+	std::unique_ptr<StagingRing> _readbackRing;
+	std::unique_ptr<PipelineLibrary> _pipelineLibrary;
+};
+/*
+ A ticket on the device timeline fence. It doesn't create any kernel object.
+*/
+class FenceObject
+{
+public:
+	FenceObject(const FenceObject&) = delete;
+	void operator=(const FenceObject&) = delete;
+
+	FenceObject(DeviceObject* deviceObject) : _fence(deviceObject->fence())
+	{
+		_value = _fence->signal(deviceObject->queue());
+	}
+	FenceObject(DeviceObject* deviceObject, uint64_t value) : _fence(deviceObject->fence()), _value(value)
+	{
+	}
+	bool isComplete()
+	{
+		return _fence->isComplete(_value);
+	}
+	void wait( FenceWaitPolicy policy = FenceWaitPolicy::Block )
+	{
+		_fence->waitFor(_value, policy);
+	}
+	uint64_t value() const
+	{
+		return _value;
+	}
+private:
+	TimelineFence* _fence;
+	uint64_t _value;
 };
 
 
@@ -378,18 +2013,33 @@ public:
 	UploadResource( const UploadResource& ) = delete;
 	void operator=( const UploadResource& ) = delete;
 
-	UploadResource( ID3D12Device* device, int64_t bytes ) : _bytes( std::max( bytes, 1LL ) )
+	UploadResource( ID3D12Device* device, int64_t bytes ) : _bytes( std::max( bytes, (int64_t)1 ) )
 	{
 		HRESULT hr;
+		CD3DX12_HEAP_PROPERTIES heapProperties( D3D12_HEAP_TYPE_UPLOAD );
+		CD3DX12_RESOURCE_DESC resourceDesc = CD3DX12_RESOURCE_DESC::Buffer( _bytes );
 		hr = device->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES( D3D12_HEAP_TYPE_UPLOAD ),
+			&heapProperties,
 			D3D12_HEAP_FLAG_NONE,
-			&CD3DX12_RESOURCE_DESC::Buffer( _bytes ),
+			&resourceDesc,
 			D3D12_RESOURCE_STATE_GENERIC_READ,
 			nullptr,
 			IID_PPV_ARGS( _resource.getAddressOf() ) );
 		DX_ASSERT( hr == S_OK, "" );
 	}
+	// placed into the device upload heap
+	UploadResource( DeviceObject* deviceObject, int64_t bytes ) : _bytes( std::max( bytes, (int64_t)1 ) ), _deviceObject( deviceObject )
+	{
+		_resource = deviceObject->heapAllocator( D3D12_HEAP_TYPE_UPLOAD )->createBuffer( _bytes, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_GENERIC_READ, &_allocation );
+	}
+	~UploadResource()
+	{
+		if( _deviceObject )
+		{
+			_resource = DxPtr<ID3D12Resource>();
+			_deviceObject->heapAllocator( D3D12_HEAP_TYPE_UPLOAD )->free( _allocation, _deviceObject->fence()->lastSignaled() );
+		}
+	}
 
 	void* map()
 	{
@@ -402,7 +2052,7 @@ public:
 	}
 	void unmap( int64_t writeBytesBeg, int64_t writeBytesEnd )
 	{
-		D3D12_RANGE writerange = { writeBytesBeg, writeBytesEnd };
+		D3D12_RANGE writerange = { (SIZE_T)writeBytesBeg, (SIZE_T)writeBytesEnd };
 		_resource->Unmap( 0, &writerange );
 	}
 	void unmap()
@@ -424,6 +2074,8 @@ public:
 private:
 	int64_t _bytes;
 	DxPtr<ID3D12Resource> _resource;
+	DeviceObject* _deviceObject = nullptr;
+	HeapAllocation _allocation;
 };
 
 template <class T>
@@ -461,6 +2113,127 @@ private:
 	int64_t _count;
 };
 
+/*
+ A copy of a buffer range into readback memory that is in flight on the queue.
+ The copy is submitted on construction and never blocks there.
+ isComplete() polls, wait() blocks, map() waits and returns the range.
+ The readback memory is handed back on destruction, which is safe even before completion.
+*/
+class ReadbackResource
+{
+public:
+	ReadbackResource( const ReadbackResource& ) = delete;
+	void operator=( const ReadbackResource& ) = delete;
+
+	ReadbackResource( DeviceObject* deviceObject, ResourceState* source, int64_t bytesBeg, int64_t bytesEnd )
+		: _deviceObject( deviceObject ), _bytes( bytesEnd - bytesBeg )
+	{
+		DX_ASSERT( 0 <= bytesBeg, "" );
+		DX_ASSERT( bytesBeg < bytesEnd, "" );
+
+		// the copy is submitted by itself, so it would run before the work of the open context
+		DX_ASSERT( !source->recording, "the buffer is recorded in a CommandContext that is not submitted" );
+
+		StagingRing* ring = deviceObject->readbackRing();
+		if( _bytes <= ring->capacity() )
+		{
+			_ring = ring->allocate( _bytes, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT );
+		}
+
+		ID3D12Resource* dst;
+		int64_t dstOffset;
+		if( _ring.ptr )
+		{
+			dst = _ring.resource;
+			dstOffset = _ring.offset;
+		}
+		else
+		{
+			// range sized, so a large buffer never costs more than what is read.
+			_resource = deviceObject->heapAllocator( D3D12_HEAP_TYPE_READBACK )->createBuffer( _bytes, D3D12_RESOURCE_FLAG_NONE, D3D12_RESOURCE_STATE_COPY_DEST, &_allocation );
+			dst = _resource.get();
+			dstOffset = 0;
+		}
+
+		CommandContext context = deviceObject->begin();
+		context.transition( source, D3D12_RESOURCE_STATE_COPY_SOURCE );
+		context.flushBarriers();
+		context.list()->CopyBufferRegion(
+			dst, dstOffset,
+			source->resource, bytesBeg, _bytes
+		);
+		_fenceValue = context.submit();
+
+		if( _ring.ptr )
+		{
+			ring->retire( _ring, _fenceValue );
+		}
+	}
+	~ReadbackResource()
+	{
+		if( _ring.ptr )
+		{
+			_deviceObject->readbackRing()->release( _ring );
+			return;
+		}
+		if( _mapped )
+		{
+			D3D12_RANGE range = {  };
+			_resource->Unmap( 0, &range );
+		}
+		_resource = DxPtr<ID3D12Resource>();
+		_deviceObject->heapAllocator( D3D12_HEAP_TYPE_READBACK )->free( _allocation, _fenceValue );
+	}
+	bool isComplete() const
+	{
+		return _deviceObject->fence()->isComplete( _fenceValue );
+	}
+	void wait( FenceWaitPolicy policy = FenceWaitPolicy::Block )
+	{
+		_deviceObject->fence()->waitFor( _fenceValue, policy );
+	}
+	uint64_t fenceValue() const
+	{
+		return _fenceValue;
+	}
+	int64_t bytes() const
+	{
+		return _bytes;
+	}
+
+	// waits for the copy. the pointer stays valid until destruction.
+	void* map( FenceWaitPolicy policy = FenceWaitPolicy::Block )
+	{
+		wait( policy );
+
+		if( _ring.ptr )
+		{
+			return _ring.ptr;
+		}
+		if( !_mapped )
+		{
+			D3D12_RANGE range = { 0, (SIZE_T)_bytes };
+			HRESULT hr = _resource->Map( 0, &range, &_mapped );
+			DX_ASSERT( hr == S_OK, "" );
+		}
+		return _mapped;
+	}
+	template <class T>
+	TypedView<T> mapTyped( FenceWaitPolicy policy = FenceWaitPolicy::Block )
+	{
+		void* p = map( policy );
+		return TypedView<T>( p, _bytes );
+	}
+private:
+	DeviceObject* _deviceObject;
+	int64_t _bytes;
+	uint64_t _fenceValue = 0;
+	StagingRing::Allocation _ring;
+	DxPtr<ID3D12Resource> _resource;
+	HeapAllocation _allocation;
+	void* _mapped = nullptr;
+};
+
 class BufferResource
 {
 public:
@@ -468,17 +2241,69 @@ public:
 	void operator=( const BufferResource& ) = delete;
 
 	BufferResource( DeviceObject* deviceObject, int64_t bytes, int64_t structureByteStride, D3D12_RESOURCE_STATES initialState = D3D12_RESOURCE_STATE_COMMON )
-		: _bytes( std::max( bytes, 1LL ) ), _structureByteStride( structureByteStride )
+		: _bytes( std::max( bytes, (int64_t)1 ) ), _structureByteStride( structureByteStride ), _deviceObject( deviceObject )
+	{
+		BufferCache* cache = deviceObject->bufferCache();
+		BufferCache::Entry entry;
+		if( cache && cache->acquire( _bytes, &entry ) )
+		{
+			_resource = entry.resource;
+			_allocation = entry.allocation;
+			_state.resource = _resource.get();
+			_state.state = entry.state;
+			_state.lastUse = entry.fenceValue;
+		}
+		else
+		{
+			// cached buffers are created with the size class so that they can serve any request of the class.
+			int64_t resourceBytes = cache ? BufferCache::sizeClass( _bytes ) : _bytes;
+			_resource = deviceObject->heapAllocator( D3D12_HEAP_TYPE_DEFAULT )->createBuffer( resourceBytes, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS, initialState, &_allocation );
+
+			_state.resource = _resource.get();
+			_state.state = initialState;
+		}
+
+		if( deviceObject->bindless() )
+		{
+			DescriptorHeap* heap = deviceObject->descriptorHeap();
+			_bindless = heap->allocate( 1 );
+			deviceObject->device()->CopyDescriptorsSimple( 1, _bindless.cpu, unorderedAccessView(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV );
+		}
+	}
+	~BufferResource()
 	{
-		HRESULT hr;
-		hr = deviceObject->device()->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES( D3D12_HEAP_TYPE_DEFAULT ),
-			D3D12_HEAP_FLAG_NONE /* I don't know */,
-			&CD3DX12_RESOURCE_DESC::Buffer( _bytes, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS ),
-			initialState,
-			nullptr,
-			IID_PPV_ARGS( _resource.getAddressOf() ) );
-		DX_ASSERT( hr == S_OK, "" );
+		DX_ASSERT( !_state.recording, "the buffer is recorded in a CommandContext that is not submitted" );
+
+		if( _uav.ptr )
+		{
+			_deviceObject->descriptorPool()->free( _uav );
+		}
+		if( _srv.ptr )
+		{
+			_deviceObject->descriptorPool()->free( _srv );
+		}
+		if( 0 <= _bindless.index )
+		{
+			_deviceObject->descriptorHeap()->free( _bindless, 1, _state.lastUse );
+		}
+
+		BufferCache* cache = _deviceObject->bufferCache();
+		if( cache )
+		{
+			BufferCache::Entry entry;
+			entry.resource = _resource;
+			entry.allocation = _allocation;
+			entry.state = _state.state;
+			entry.bytes = BufferCache::sizeClass( _bytes );
+			entry.fenceValue = _state.lastUse;
+			if( entry.bytes == (int64_t)_resource->GetDesc().Width )
+			{
+				cache->release( entry );
+				return;
+			}
+		}
+		_resource = DxPtr<ID3D12Resource>();
+		_deviceObject->heapAllocator( D3D12_HEAP_TYPE_DEFAULT )->free( _allocation, _state.lastUse );
 	}
 	int64_t bytes() const
 	{
@@ -488,10 +2313,18 @@ public:
 	{
 		return _bytes / _structureByteStride;
 	}
+	int64_t structureByteStride() const
+	{
+		return _structureByteStride;
+	}
 	ID3D12Resource* resource()
 	{
 		return _resource.get();
 	}
+	ResourceState* state()
+	{
+		return &_state;
+	}
 	D3D12_UNORDERED_ACCESS_VIEW_DESC UAVDescription() const
 	{
 		D3D12_UNORDERED_ACCESS_VIEW_DESC d = {};
@@ -503,55 +2336,152 @@ public:
 		d.Buffer.CounterOffsetInBytes = 0;
 		return d;
 	}
+	// the UAV in ResourceDescriptorHeap. stable for the lifetime of the buffer
+	uint32_t bindlessIndex() const
+	{
+		DX_ASSERT( 0 <= _bindless.index, "call DeviceObject::enableBindless() before creating the buffer" );
+		return (uint32_t)_bindless.index;
+	}
+	// non-shader-visible. created on the first call
+	D3D12_CPU_DESCRIPTOR_HANDLE unorderedAccessView()
+	{
+		if( !_uav.ptr )
+		{
+			D3D12_UNORDERED_ACCESS_VIEW_DESC d = UAVDescription();
+			_uav = _deviceObject->descriptorPool()->allocate( &_uavGeneration );
+			_deviceObject->device()->CreateUnorderedAccessView( _resource.get(), nullptr, &d, _uav );
+		}
+		return _uav;
+	}
+	D3D12_CPU_DESCRIPTOR_HANDLE shaderResourceView()
+	{
+		if( !_srv.ptr )
+		{
+			D3D12_SHADER_RESOURCE_VIEW_DESC d = {};
+			d.Format = DXGI_FORMAT_UNKNOWN;
+			d.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+			d.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+			d.Buffer.FirstElement = 0;
+			d.Buffer.NumElements = (UINT)( _bytes / _structureByteStride );
+			d.Buffer.StructureByteStride = (UINT)_structureByteStride;
+			_srv = _deviceObject->descriptorPool()->allocate( &_srvGeneration );
+			_deviceObject->device()->CreateShaderResourceView( _resource.get(), &d, _srv );
+		}
+		return _srv;
+	}
+	// the generations of the views. see DescriptorPool::allocate
+	uint64_t unorderedAccessViewGeneration()
+	{
+		unorderedAccessView();
+		return _uavGeneration;
+	}
+	uint64_t shaderResourceViewGeneration()
+	{
+		shaderResourceView();
+		return _srvGeneration;
+	}
 	void setName( std::wstring name )
 	{
 		_resource->SetName( name.c_str() );
 	}
 
+	/*
+	 The returned pointer lives in the device upload ring when the buffer fits into it.
+	 Otherwise it is host memory that is streamed through the ring in chunks on unmapForWriting.
+	*/
 	void* mapForWriting( DeviceObject *deviceObject )
 	{
-		DX_ASSERT( !_uploader, "");
-
-		HRESULT hr;
-		hr = deviceObject->device()->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
-			D3D12_HEAP_FLAG_NONE,
-			&CD3DX12_RESOURCE_DESC::Buffer(_bytes),
-			D3D12_RESOURCE_STATE_GENERIC_READ,
-			nullptr,
-			IID_PPV_ARGS(_uploader.getAddressOf()));
-		DX_ASSERT( hr == S_OK, "" );
+		DX_ASSERT( !_upload.ptr && _uploadStaging.empty(), "");
 
-		// no read
-		D3D12_RANGE range = {};
-		void* p;
-		hr = _uploader->Map( 0, &range, &p );
-		DX_ASSERT(hr == S_OK, "");
-		return (void*)p;
+		StagingRing* ring = deviceObject->uploadRing();
+		if( _bytes <= ring->capacity() )
+		{
+			_upload = ring->allocate( _bytes, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT );
+			if( _upload.ptr )
+			{
+				return _upload.ptr;
+			}
+		}
+		_uploadStaging.resize( _bytes );
+		return _uploadStaging.data();
 	}
-	void unmapForWriting( DeviceObject *deviceObject, int64_t bytesBeg, int64_t bytesEnd )
+	// returns the fence value of the last copy.
+	uint64_t unmapForWriting( DeviceObject *deviceObject, int64_t bytesBeg, int64_t bytesEnd )
 	{
-		DX_ASSERT( _uploader, "");
+		DX_ASSERT( _upload.ptr || !_uploadStaging.empty(), "");
 		DX_ASSERT( 0 <= bytesBeg, "");
 		DX_ASSERT( bytesEnd <= _bytes, "");
+		DX_ASSERT( !_state.recording, "the buffer is recorded in a CommandContext that is not submitted" );
+
+		uint64_t ticket;
+		if( _upload.ptr )
+		{
+			CommandContext context = deviceObject->begin();
+			context.transition( &_state, D3D12_RESOURCE_STATE_COPY_DEST );
+			context.flushBarriers();
+			context.list()->CopyBufferRegion(
+				_resource.get(), bytesBeg,
+				_upload.resource, _upload.offset + bytesBeg, bytesEnd - bytesBeg
+			);
+			ticket = context.submit();
+			deviceObject->uploadRing()->retire( _upload, ticket );
+			_upload = StagingRing::Allocation();
+		}
+		else
+		{
+			ticket = upload( deviceObject, _uploadStaging.data() + bytesBeg, bytesBeg, bytesEnd );
+			_uploadStaging = std::vector<uint8_t>();
+		}
+		return ticket;
+	}
+
+	// copy host memory into [bytesBeg, bytesEnd) through the upload ring without waiting for the GPU. returns the fence value of the last copy.
+	// the copies are submitted by themselves. submit the contexts that recorded the buffer first.
+	uint64_t upload( DeviceObject* deviceObject, const void* src, int64_t bytesBeg, int64_t bytesEnd )
+	{
+		DX_ASSERT( 0 <= bytesBeg, "" );
+		DX_ASSERT( bytesEnd <= _bytes, "" );
+		DX_ASSERT( !_state.recording, "the buffer is recorded in a CommandContext that is not submitted" );
 
-		D3D12_RANGE range = { bytesBeg, bytesEnd };
-		_uploader->Unmap( 0, &range );
+		StagingRing* ring = deviceObject->uploadRing();
 
-		deviceObject->executeCommand(
-			[&](ID3D12GraphicsCommandList* commandList) {
-				commandList->CopyBufferRegion(
-					_resource.get(), bytesBeg,
-					_uploader.get(), bytesBeg, bytesEnd - bytesBeg
-				);
+		// a quarter of the ring keeps several chunks in flight while the next one is filled.
+		int64_t chunkBytes = ring->capacity() / 4;
+		uint64_t ticket = 0;
+		for( int64_t o = bytesBeg; o < bytesEnd; o += chunkBytes )
+		{
+			int64_t n = std::min( chunkBytes, bytesEnd - o );
+			StagingRing::Allocation a = ring->allocate( n, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT );
+
+			// the ring is held by mapped buffers. a temporary upload buffer is freed after the copy.
+			std::unique_ptr<UploadResource> temporary;
+			if( !a.ptr )
+			{
+				temporary = std::unique_ptr<UploadResource>( new UploadResource( deviceObject, n ) );
+				a.resource = temporary->resource();
+				a.ptr = (uint8_t*)temporary->map();
 			}
-		);
 
-		// wait for copying in order to free upload resource.
-		FenceObject fence( deviceObject );
-		fence.wait();
+			memcpy( a.ptr, (const uint8_t*)src + ( o - bytesBeg ), n );
+			if( temporary )
+			{
+				temporary->unmap( 0, n );
+			}
 
-		_uploader = DxPtr<ID3D12Resource>();
+			CommandContext context = deviceObject->begin();
+			context.transition( &_state, D3D12_RESOURCE_STATE_COPY_DEST );
+			context.flushBarriers();
+			context.list()->CopyBufferRegion(
+				_resource.get(), o,
+				a.resource, a.offset, n
+			);
+			ticket = context.submit();
+			if( !temporary )
+			{
+				ring->retire( a, ticket );
+			}
+		}
+		return ticket;
 	}
 	template <class T>
 	TypedView<T> mapTypedForWriting( DeviceObject* deviceObject )
@@ -560,65 +2490,58 @@ public:
 		return TypedView<T>(p, bytes());
 	}
 
-	void* mapForReading( DeviceObject* deviceObject, int64_t bytesBeg, int64_t bytesEnd )
+	/*
+	 Starts copying [bytesBeg, bytesEnd) back without waiting for it.
+	 Writes recorded after this call do not affect the result. Contexts that recorded the buffer have to be submitted before.
+	*/
+	std::unique_ptr<ReadbackResource> readAsync( DeviceObject* deviceObject, int64_t bytesBeg, int64_t bytesEnd )
 	{
-		DX_ASSERT( !_downloader, "" );
-		DX_ASSERT( 0 <= bytesBeg, "" );
 		DX_ASSERT( bytesEnd <= _bytes, "" );
+		return std::unique_ptr<ReadbackResource>( new ReadbackResource( deviceObject, &_state, bytesBeg, bytesEnd ) );
+	}
 
-		HRESULT hr;
-		hr = deviceObject->device()->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
-			D3D12_HEAP_FLAG_NONE,
-			&CD3DX12_RESOURCE_DESC::Buffer(_bytes),
-			D3D12_RESOURCE_STATE_COPY_DEST,
-			nullptr,
-			IID_PPV_ARGS(_downloader.getAddressOf()));
-		DX_ASSERT( hr == S_OK, "" );
-
-		deviceObject->executeCommand( 
-			[&](ID3D12GraphicsCommandList* commandList) {
-				commandList->CopyBufferRegion(
-					_downloader.get(), bytesBeg,
-					_resource.get(), bytesBeg, bytesEnd - bytesBeg
-				);
-			}
-		);
-
-		// wait for copying
-		FenceObject fence(deviceObject);
-		fence.wait();
-
-		D3D12_RANGE range = { bytesBeg, bytesEnd };
-		void* p;
-		hr = _downloader->Map( 0, &range, &p );
-		DX_ASSERT(hr == S_OK, "");
-
-		return (void*)p;
+	/*
+	 Only [bytesBeg, bytesEnd) is copied back. The returned pointer points at bytesBeg.
+	 Same as readAsync followed by a wait.
+	*/
+	void* mapForReading( DeviceObject* deviceObject, int64_t bytesBeg, int64_t bytesEnd )
+	{
+		DX_ASSERT( !_readback, "" );
+		_readback = readAsync( deviceObject, bytesBeg, bytesEnd );
+		return _readback->map();
 	}
+	// the view covers [bytesBeg, bytesEnd) only.
 	template <class T>
 	TypedView<T> mapTypedForReading(DeviceObject* deviceObject, int64_t bytesBeg, int64_t bytesEnd)
 	{
 		void* p = mapForReading( deviceObject, bytesBeg, bytesEnd );
-		return TypedView<T>( p , bytes() );
+		return TypedView<T>( p , bytesEnd - bytesBeg );
 	}
 	void unmapForReading()
 	{
-		DX_ASSERT( _downloader, "");
-		D3D12_RANGE range = {  };
-		_downloader->Unmap(0, &range);
-		_downloader = DxPtr<ID3D12Resource>();
+		DX_ASSERT( _readback, "");
+		_readback.reset();
 	}
 private:
 	int64_t _bytes;
 	int64_t _structureByteStride;
+	DeviceObject* _deviceObject;
 	DxPtr<ID3D12Resource> _resource;
-	DxPtr<ID3D12Resource> _uploader;
-	DxPtr<ID3D12Resource> _downloader;
+	HeapAllocation _allocation;
+	ResourceState _state;
+	D3D12_CPU_DESCRIPTOR_HANDLE _uav = {};
+	D3D12_CPU_DESCRIPTOR_HANDLE _srv = {};
+	uint64_t _uavGeneration = 0;
+	uint64_t _srvGeneration = 0;
+	DescriptorTable _bindless;
+	StagingRing::Allocation _upload;
+	std::vector<uint8_t> _uploadStaging;
+	std::unique_ptr<ReadbackResource> _readback;
 };
 
 /*
- data is D3D12_HEAP_TYPE_UPLOAD pointer. please make sure this object is alive during shader execution.
+ The value is kept on the CPU. Every dispatch copies the current value into ConstantAllocator memory that only its submission reads,
+ so the value can be changed between queued dispatches without waiting for the GPU.
 */
 template <class T>
 class ConstantBuffer
@@ -627,420 +2550,1003 @@ public:
 	ConstantBuffer( const ConstantBuffer& ) = delete;
 	void operator=( const ConstantBuffer& ) = delete;
 
-	ConstantBuffer( DeviceObject* deviceObject )
-		: _bytes( alignedExpand( sizeof(T), 256 ) )
+	ConstantBuffer() : _value()
 	{
 		static_assert( 1 <= sizeof(T), "T shouldn't be empty" );
+		static_assert( std::is_trivially_copyable<T>::value, "T should be trivially copyable" );
+	}
+	int64_t bytes() const {
+		return sizeof(T);
+	}
+	const T& value() const
+	{
+		return _value;
+	}
+	T* operator->()
+	{
+		return &_value;
+	}
+private:
+	T _value;
+};
 
-		HRESULT hr;
-		hr = deviceObject->device()->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES( D3D12_HEAP_TYPE_UPLOAD ),
-			D3D12_HEAP_FLAG_NONE,
-			&CD3DX12_RESOURCE_DESC::Buffer( _bytes ),
-			D3D12_RESOURCE_STATE_GENERIC_READ,
-			nullptr,
-			IID_PPV_ARGS(_resource.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
+class ArgumentHeap
+{
+public:
+	ArgumentHeap( const ArgumentHeap& ) = delete;
+	void operator=( const ArgumentHeap& ) = delete;
 
-		D3D12_RANGE range = {};
-		void* p;
-		hr = _resource->Map(0, &range, &p);
-		DX_ASSERT(hr == S_OK, "");
-		_ptr = (T *)p;
+	// bindless only. it can be shared by any shaders without bindings
+	ArgumentHeap( DeviceObject* deviceObject ) : ArgumentHeap( deviceObject, std::map<std::string, int>() )
+	{
 	}
-	~ConstantBuffer()
+	ArgumentHeap( DeviceObject* deviceObject, std::map<std::string, int> var2index, const std::map<std::string, RootParameter>& rootParameters = std::map<std::string, RootParameter>() )
+		: _var2index( var2index ), _heap( deviceObject->descriptorHeap() ), _constants( deviceObject->constantAllocator() ), _fence( deviceObject->fence() ), _sources( var2index.size() ), _generations( var2index.size() )
 	{
-		D3D12_RANGE range = {};
-		_resource->Unmap( 0, &range );
+		ID3D12Device* device = deviceObject->device();
+		device->AddRef();
+		_device = DxPtr<ID3D12Device>(device);
+
+		for( const auto& p : rootParameters )
+		{
+			RootArgument& argument = _rootArguments[p.first];
+			argument.parameter = p.second;
+			argument.values.resize( p.second.num32BitValues );
+		}
 	}
-	ID3D12Resource* resource()
+	~ArgumentHeap()
 	{
-		return _resource.get();
+		for( const Table& table : _tables )
+		{
+			DX_ASSERT( !table.use.recording, "the table is used by an open context" );
+			_heap->free( table.table, _sources.size(), table.use.lastUse );
+		}
 	}
-	int64_t bytes() const {
-		return _bytes;
+
+	// binding only stores the view of the resource. the table is assembled by the next dispatch.
+	void RWStructured( const char *var, BufferResource *resource )
+	{
+		auto root = _rootArguments.find( var );
+		if( root != _rootArguments.end() )
+		{
+			DX_ASSERT( root->second.parameter.type == ShaderBindingType::RootUAV, "" );
+			DX_ASSERT( 0 < resource->structureByteStride(), "a root descriptor has to be a structured or raw buffer" );
+			root->second.address = resource->resource()->GetGPUVirtualAddress();
+		}
+		else
+		{
+			DX_ASSERT(_var2index.count(var), "");
+			bind( _var2index[var], resource->unorderedAccessView(), resource->unorderedAccessViewGeneration() );
+		}
+
+		_unorderedAccesses[var] = resource->state();
+	}
+	// StructuredBuffer. the buffer is in NON_PIXEL_SHADER_RESOURCE state during the dispatch.
+	void Structured( const char *var, BufferResource *resource )
+	{
+		auto root = _rootArguments.find( var );
+		if( root != _rootArguments.end() )
+		{
+			DX_ASSERT( root->second.parameter.type == ShaderBindingType::RootSRV, "" );
+			DX_ASSERT( 0 < resource->structureByteStride(), "a root descriptor has to be a structured or raw buffer" );
+			root->second.address = resource->resource()->GetGPUVirtualAddress();
+		}
+		else
+		{
+			DX_ASSERT(_var2index.count(var), "");
+			bind( _var2index[var], resource->shaderResourceView(), resource->shaderResourceViewGeneration() );
+		}
+
+		_shaderResources[var] = resource->state();
+	}
+	// the buffer is read by every dispatch until it is unbound, so the value can be changed between dispatches.
+	template <class T>
+	void Constant( const char* var, ConstantBuffer<T>* resource )
+	{
+		auto root = _rootArguments.find( var );
+		if( root != _rootArguments.end() )
+		{
+			RootArgument& argument = root->second;
+			DX_ASSERT( argument.parameter.type == ShaderBindingType::RootConstants || argument.parameter.type == ShaderBindingType::RootCBV, "" );
+			DX_ASSERT( argument.parameter.type != ShaderBindingType::RootConstants || sizeof( T ) <= argument.values.size() * sizeof( uint32_t ), "the value is larger than the cbuffer" );
+			argument.data = &resource->value();
+			argument.bytes = sizeof( T );
+			argument.bound = true;
+			return;
+		}
+		DX_ASSERT(_var2index.count(var), "");
+		int index = _var2index[var];
+		_sources[index] = D3D12_CPU_DESCRIPTOR_HANDLE();
+		_generations[index] = 0;
+		_tableConstants[index] = { &resource->value(), (int64_t)sizeof( T ) };
+	}
+
+	// the value is recorded into the command list by the next dispatch. no buffer is needed.
+	template <class T>
+	void Inline( const char* var, const T& value )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "T should be trivially copyable" );
+		auto root = _rootArguments.find( var );
+		DX_ASSERT( root != _rootArguments.end() && root->second.parameter.type == ShaderBindingType::RootConstants, "the cbuffer is not root constants. see CompileOptions::rootConstantBudget" );
+		DX_ASSERT( sizeof( T ) <= root->second.values.size() * sizeof( uint32_t ), "the value is larger than the cbuffer" );
+		memcpy( root->second.values.data(), &value, sizeof( T ) );
+		root->second.data = nullptr;
+		root->second.bound = true;
+	}
+	template <class T>
+	void ConstantGlobal(ConstantBuffer<T>* resource)
+	{
+		Constant("$Globals", resource);
+	}
+
+	// ezdxBindlessIndex( slot ) of EzDx.hlsli returns the index of the buffer. it is accessed as UAV.
+	void Bindless( int slot, BufferResource *resource )
+	{
+		DX_ASSERT( 0 <= slot && slot < (int)( sizeof( BindlessConstants ) / sizeof( uint32_t ) ), "" );
+		_bindless.indices[slot] = resource->bindlessIndex();
+		_unorderedAccesses["EzDxBindless" + std::to_string( slot )] = resource->state();
+	}
+	const BindlessConstants& bindlessConstants() const
+	{
+		return _bindless;
+	}
+	ID3D12DescriptorHeap* descriptorHeap()
+	{
+		return _heap->heap();
+	}
+
+	/*
+	 The table for a dispatch recorded into the context. Unchanged bindings reuse the last table.
+	 Otherwise the views are gathered with one CopyDescriptors into a table that no submission refers to anymore.
+	 Retired tables beyond one spare are returned to the heap, so rebinding per dispatch does not keep the peak forever.
+	 A table with constants is transient, as every dispatch refers to its own copy of them.
+	*/
+	D3D12_GPU_DESCRIPTOR_HANDLE commit( CommandContext& context )
+	{
+		if( !_tableConstants.empty() )
+		{
+			DescriptorTable table = _heap->allocateTransient( context, _sources.size() );
+			copyViews( table );
+			for( const auto& c : _tableConstants )
+			{
+				D3D12_CONSTANT_BUFFER_VIEW_DESC d = {};
+				d.BufferLocation = _constants->push( context, c.second.data, c.second.bytes );
+				d.SizeInBytes = (UINT)alignedExpand( c.second.bytes, D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT );
+				_device->CreateConstantBufferView( &d, _heap->table( table.index + c.first ).cpu );
+			}
+			return table.gpu;
+		}
+
+		if( _dirty || !_current )
+		{
+			Table* table = nullptr;
+			bool spare = false;
+			for( auto it = _tables.begin(); it != _tables.end(); )
+			{
+				if( it->use.recording || !_fence->isComplete( it->use.lastUse ) )
+				{
+					++it;
+				}
+				else if( !table || !spare )
+				{
+					spare = table != nullptr;
+					table = table ? table : &*it;
+					++it;
+				}
+				else
+				{
+					_heap->free( it->table, _sources.size(), it->use.lastUse );
+					it = _tables.erase( it );
+				}
+			}
+			if( !table )
+			{
+				_tables.emplace_back();
+				table = &_tables.back();
+				table->table = _heap->allocate( _sources.size() );
+			}
+			copyViews( table->table );
+			_current = table;
+			_dirty = false;
+		}
+		context.use( &_current->use );
+		return _current->table.gpu;
+	}
+
+	// resources bound as UAV. Shader::dispatch uses them for barriers.
+	const std::map<std::string, ResourceState*>& unorderedAccesses() const
+	{
+		return _unorderedAccesses;
+	}
+	// resources bound as SRV. Shader::dispatch transitions them.
+	const std::map<std::string, ResourceState*>& shaderResources() const
+	{
+		return _shaderResources;
+	}
+
+	// sets the bindings outside of the table. constants are copied at this point.
+	void commitRoot( CommandContext& context )
+	{
+		for( auto& root : _rootArguments )
+		{
+			RootArgument& argument = root.second;
+			const RootParameter& parameter = argument.parameter;
+			if( parameter.type == ShaderBindingType::RootConstants )
+			{
+				DX_ASSERT( argument.bound, "a variable is not bound" );
+				if( argument.data )
+				{
+					memcpy( argument.values.data(), argument.data, argument.bytes );
+				}
+				context.list()->SetComputeRoot32BitConstants( parameter.index, parameter.num32BitValues, argument.values.data(), 0 );
+				continue;
+			}
+			if( parameter.type == ShaderBindingType::RootCBV && argument.data )
+			{
+				argument.address = _constants->push( context, argument.data, argument.bytes );
+			}
+
+			DX_ASSERT( argument.address != 0, "a variable is not bound" );
+			switch( parameter.type )
+			{
+			case ShaderBindingType::RootCBV:
+				context.list()->SetComputeRootConstantBufferView( parameter.index, argument.address );
+				break;
+			case ShaderBindingType::RootSRV:
+				context.list()->SetComputeRootShaderResourceView( parameter.index, argument.address );
+				break;
+			case ShaderBindingType::RootUAV:
+				context.list()->SetComputeRootUnorderedAccessView( parameter.index, argument.address );
+				break;
+			default:
+				DX_ASSERT( 0, "not a root descriptor" );
+				break;
+			}
+		}
+	}
+private:
+	// one CopyDescriptors. the slots of constants are skipped.
+	void copyViews( const DescriptorTable& table )
+	{
+		if( _sources.empty() )
+		{
+			return;
+		}
+		if( _tableConstants.empty() )
+		{
+			for( D3D12_CPU_DESCRIPTOR_HANDLE source : _sources )
+			{
+				DX_ASSERT( source.ptr != 0, "a variable is not bound" );
+			}
+			std::vector<UINT> ones( _sources.size(), 1 );
+			UINT count = (UINT)_sources.size();
+			_device->CopyDescriptors( 1, &table.cpu, &count, count, _sources.data(), ones.data(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV );
+			return;
+		}
+
+		std::vector<D3D12_CPU_DESCRIPTOR_HANDLE> dst;
+		std::vector<D3D12_CPU_DESCRIPTOR_HANDLE> src;
+		for( size_t i = 0; i < _sources.size(); ++i )
+		{
+			if( _tableConstants.count( (int)i ) )
+			{
+				continue;
+			}
+			DX_ASSERT( _sources[i].ptr != 0, "a variable is not bound" );
+			dst.push_back( _heap->table( table.index + i ).cpu );
+			src.push_back( _sources[i] );
+		}
+		if( !src.empty() )
+		{
+			std::vector<UINT> ones( src.size(), 1 );
+			_device->CopyDescriptors( (UINT)dst.size(), dst.data(), ones.data(), (UINT)src.size(), src.data(), ones.data(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV );
+		}
+	}
+	// an equal handle of another generation is the view of a resource that reused a freed descriptor
+	void bind( int index, D3D12_CPU_DESCRIPTOR_HANDLE view, uint64_t generation )
+	{
+		if( _sources[index].ptr != view.ptr || _generations[index] != generation )
+		{
+			_sources[index] = view;
+			_generations[index] = generation;
+			_dirty = true;
+		}
+	}
+
+	// a version of the table. a table that a submission may still read is never written.
+	struct Table
+	{
+		DescriptorTable table;
+		ResourceState use;
+	};
+
+	// root arguments are recorded by value, so they need no versions
+	struct RootArgument
+	{
+		RootParameter parameter;
+		std::vector<uint32_t> values;
+		bool bound = false;
+		D3D12_GPU_VIRTUAL_ADDRESS address = 0;
+
+		// the value of a ConstantBuffer. copied by every dispatch
+		const void* data = nullptr;
+		int64_t bytes = 0;
+	};
+	struct ConstantSource
+	{
+		const void* data;
+		int64_t bytes;
+	};
+
+	std::map<std::string, int> _var2index;
+	std::map<std::string, ResourceState*> _unorderedAccesses;
+	std::map<std::string, ResourceState*> _shaderResources;
+	DescriptorHeap* _heap;
+	ConstantAllocator* _constants;
+	TimelineFence* _fence;
+	std::vector<D3D12_CPU_DESCRIPTOR_HANDLE> _sources;
+	std::vector<uint64_t> _generations;
+	std::map<int, ConstantSource> _tableConstants;
+	std::list<Table> _tables; // _current points into it
+	Table* _current = nullptr;
+	bool _dirty = true;
+	BindlessConstants _bindless = {};
+	std::map<std::string, RootArgument> _rootArguments;
+	DxPtr<ID3D12Device> _device;
+};
+
+/*
+ Construction returns immediately. Compilation and pipeline creation run on CompileService,
+ and the first call that needs the result waits for it.
+*/
+class Shader
+{
+public:
+	Shader( const Shader& ) = delete;
+	void operator=( const Shader& ) = delete;
+
+	Shader( DeviceObject *deviceObject, const char *filename, const char *includeDir, CompileMode compileMode )
+		: Shader( deviceObject, filename, includeDir, CompileOptions( compileMode ) )
+	{
 	}
-	// please not read from this ptr
-	// https://docs.microsoft.com/en-us/windows/win32/api/d3d12/nf-d3d12-id3d12resource-map
-	T* operator->()
+	Shader( DeviceObject *deviceObject, const char *filename, const char *includeDir, const CompileOptions& options )
+		: Shader( deviceObject, std::make_shared<ShaderSource>( filename ), includeDir, options )
 	{
-		return _ptr;
 	}
-private:
-	T* _ptr;
-	int64_t _bytes = 0;
-	DxPtr<ID3D12Resource> _resource;
-};
 
-class DXCFileBlob : public IDxcBlob
-{
-public:
-	DXCFileBlob( const char* file ):_counter(1)
+	// compiles the file as a library and links it with the shared libraries. the entry point needs [shader("compute")].
+	// an edit of the file recompiles only the file itself.
+	Shader( DeviceObject *deviceObject, const char *filename, const char *includeDir, const std::vector<std::shared_ptr<ShaderLibrary>>& libraries, const CompileOptions& options = CompileOptions() )
 	{
-		FILE* fp = fopen( file, "rb" );
-		if( fp == 0 )
+		std::string file = filename;
+		std::string include = includeDir;
+		CompileOptions resolved = resolveTarget( deviceObject, options );
+		for( const std::shared_ptr<ShaderLibrary>& library : libraries )
 		{
-			return;
+			DX_ASSERT( library->options().target <= resolved.target, "a library cannot be linked into a lower target" );
 		}
-		fseek( fp, 0, SEEK_END );
-
-		_data.resize( ftell( fp ) );
-
-		fseek( fp, 0, SEEK_SET );
-
-		size_t s = fread( _data.data(), 1, _data.size(), fp );
-		DX_ASSERT( s == _data.size(), "failed to load file." );
+		_build = CompileService::service().enqueue( [this, deviceObject, file, include, libraries, resolved]() {
+			buildLinked( deviceObject, file, include, libraries, resolved );
+		} );
+	}
 
-		fclose( fp );
-		fp = nullptr;
+	// loads a prebuilt shader without DXC. the pack has to stay alive until the shader is ready.
+	Shader( DeviceObject *deviceObject, const ShaderPack* pack, const char* name, const CompileOptions& options = CompileOptions() )
+	{
+		std::string packName = name;
+		CompileOptions resolved = resolveTarget( deviceObject, options );
+		_build = CompileService::service().enqueue( [this, deviceObject, pack, packName, resolved]() {
+			ShaderPackEntry entry;
+			bool found = pack->find( packName, resolved, &entry );
+			DX_ASSERT( found, "the shader is not in the pack" );
+			createPipeline( deviceObject, entry.il, entry.ilBytes, entry.rootSignature, entry.rootSignatureBytes, entry.reflection );
+		} );
 	}
-	LPVOID STDMETHODCALLTYPE GetBufferPointer(void) override 
+	~Shader()
 	{
-		return _data.data();
+		if( _watch )
+		{
+			FileWatcher::watcher().remove( _watch );
+		}
+		wait();
+
+		// a reload can queue another one when a file changed while it was running
+		for( ;; )
+		{
+			std::future<void> reload;
+			{
+				std::lock_guard<std::mutex> lock( _reloadMutex );
+				_reloadAgain = false;
+				reload = std::move( _reload );
+			}
+			if( !reload.valid() )
+			{
+				break;
+			}
+			reload.wait();
+		}
 	}
-	SIZE_T STDMETHODCALLTYPE GetBufferSize(void) override
+
+	/*
+	 Rebuilds the shader in the background whenever its source or one of its includes changes, and switches to the new pipeline
+	 at the next dispatch once no open context refers to the old one. A source with errors keeps the old pipeline.
+	 Only shaders built from a file can be reloaded, and a reload has to keep the bindings as argument heaps are laid out by them.
+	*/
+	void enableHotReload()
 	{
-		return _data.size();
+		DX_ASSERT( !_filename.empty(), "only shaders built from a file can be reloaded" );
+		wait();
+		if( _watch )
+		{
+			return;
+		}
+		_watch = FileWatcher::watcher().add( _dependencies, [this]() {
+			std::lock_guard<std::mutex> lock( _reloadMutex );
+			if( _reloading )
+			{
+				_reloadAgain = true;
+				return;
+			}
+			_reloading = true;
+			_reload = CompileService::service().enqueue( [this]() { reload(); } );
+		} );
 	}
-	virtual ULONG STDMETHODCALLTYPE AddRef(void)
+
+	// why the last reload was rejected, and empty once a reload is applied. the shader keeps the previous pipeline meanwhile.
+	std::string lastReloadError() const
 	{
-		ULONG c = _counter++;
-		return c + 1;
+		std::lock_guard<std::mutex> lock( _reloadMutex );
+		return _reloadError;
 	}
-	virtual ULONG STDMETHODCALLTYPE Release(void)
+
+	// one shader per entry point of a file. the file is read and preprocessed once for all of them,
+	// but every entry point is still a compile of its own as a cs target has exactly one.
+	static std::vector<std::unique_ptr<Shader>> createEntryPoints( DeviceObject *deviceObject, const char *filename, const char *includeDir, const std::vector<std::string>& entryPoints, const CompileOptions& options = CompileOptions() )
 	{
-		ULONG c = _counter--;
-		if (c - 1 == 0)
+		std::shared_ptr<ShaderSource> source = std::make_shared<ShaderSource>( filename );
+		std::vector<std::unique_ptr<Shader>> shaders;
+		for( const std::string& entryPoint : entryPoints )
 		{
-			delete this;
+			CompileOptions o = options;
+			o.entryPoint = entryPoint;
+			shaders.push_back( std::unique_ptr<Shader>( new Shader( deviceObject, source, includeDir, o ) ) );
 		}
-		return c - 1;
+		return shaders;
 	}
 
-	HRESULT STDMETHODCALLTYPE QueryInterface(
-		/* [in] */ REFIID riid,
-		/* [iid_is][out] */ _COM_Outptr_ void __RPC_FAR* __RPC_FAR* ppvObject)
+	// a shared_future, as wait_for is not safe on a future that get() consumes on another thread
+	bool isReady() const
 	{
-		if ((riid == __uuidof(IDxcBlob)) || (riid == IID_IUnknown))
+		return _ready || _build.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+	}
+	void wait() const
+	{
+		if( _ready )
 		{
-			*ppvObject = (void*)this;
-			AddRef(); // -- Maintain the reference count
+			return;
 		}
-		else
-			*ppvObject = NULL;
+		std::lock_guard<std::mutex> lock( _buildMutex );
+		if( !_ready )
+		{
+			_build.get();
+			_ready = true;
+		}
+	}
 
-		return (*ppvObject == NULL) ? E_NOINTERFACE : S_OK;
+	ArgumentHeap* createArgumentHeap( DeviceObject* deviceObject ) const
+	{
+		wait();
+		return new ArgumentHeap( deviceObject, _var2index, _rootParameters );
 	}
-private:
-	std::atomic<ULONG> _counter;
-	std::vector<uint8_t> _data;
-};
 
+	// asynchronous. returns the fence value signaled after the dispatch.
+	uint64_t dispatch( DeviceObject* deviceObject, ArgumentHeap* arg, int64_t x, int64_t y, int64_t z)
+	{
+		CommandContext context = deviceObject->begin();
+		dispatch( context, arg, x, y, z );
+		return context.submit();
+	}
 
-class Compiler
-{
-public:
-	Compiler()
+	// records the dispatch into an open context. it is executed by context.submit(). x, y, z are thread group counts.
+	void dispatch( CommandContext& context, ArgumentHeap* arg, int64_t x, int64_t y, int64_t z )
 	{
-		HRESULT hr;
-		hr = DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(_dxUtils.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
-		hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(_dxCompiler.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
+		wait();
+		applyReload();
+
+		const int64_t maxGroups = D3D12_CS_DISPATCH_MAX_THREAD_GROUPS_PER_DIMENSION;
+		DX_ASSERT( x <= maxGroups && y <= maxGroups && z <= maxGroups, "use dispatchThreads() for larger grids" );
+
+		int64_t groups[3] = { x, y, z };
+		DispatchConstants constants = dispatchConstants();
+		for( int i = 0; i < 3; ++i )
+		{
+			constants.threadCount[i] = (uint32_t)std::min( groups[i] * _groupSize[i], (int64_t)UINT32_MAX );
+		}
+		int64_t threads = groups[0] * groups[1] * groups[2] * constants.groupThreads;
+		constants.foldWidth = (uint32_t)x;
+		constants.foldRows = (uint32_t)y;
+		constants.linearThreadCount[0] = (uint32_t)( threads & 0xFFFFFFFF );
+		constants.linearThreadCount[1] = (uint32_t)( threads >> 32 );
+		record( context, arg, constants, x, y, z );
 	}
-	static Compiler& compiler()
+
+	/*
+	 Dispatches a logical 1D thread count. The grid is folded into 2D and split into several dispatches when it exceeds the per-dimension limit.
+	 The shader has to include EzDx.hlsli and use ezdxLinearIndex() / ezdxInRange().
+	*/
+	void dispatchThreads( CommandContext& context, ArgumentHeap* arg, int64_t threads )
 	{
-		static Compiler c;
-		return c;
+		wait();
+		applyReload();
+
+		DX_ASSERT( 0 <= _dispatchConstantsIndex, "the shader doesn't include EzDx.hlsli" );
+
+		const int64_t maxGroups = D3D12_CS_DISPATCH_MAX_THREAD_GROUPS_PER_DIMENSION;
+		int64_t groupThreads = (int64_t)_groupSize[0] * _groupSize[1] * _groupSize[2];
+		int64_t groups = ( threads + groupThreads - 1 ) / groupThreads;
+
+		DispatchConstants constants = dispatchConstants();
+		constants.linearThreadCount[0] = (uint32_t)( threads & 0xFFFFFFFF );
+		constants.linearThreadCount[1] = (uint32_t)( threads >> 32 );
+
+		for( int64_t base = 0; base < groups; base += maxGroups * maxGroups )
+		{
+			int64_t n = std::min( groups - base, maxGroups * maxGroups );
+			int64_t foldWidth = std::min( n, maxGroups );
+			int64_t rows = ( n + foldWidth - 1 ) / foldWidth;
+
+			constants.foldWidth = (uint32_t)foldWidth;
+			constants.foldRows = (uint32_t)rows;
+			constants.linearGroupBase[0] = (uint32_t)( base & 0xFFFFFFFF );
+			constants.linearGroupBase[1] = (uint32_t)( base >> 32 );
+			record( context, arg, constants, foldWidth, rows, 1 );
+		}
 	}
-	IDxcUtils* dxUtils()
+
+	/*
+	 Dispatches a logical 2D or 3D thread count. Each dimension is split into several dispatches when it exceeds the per-dimension limit.
+	 The shader has to include EzDx.hlsli and use ezdxThreadID() / ezdxInRange().
+	*/
+	void dispatchThreads( CommandContext& context, ArgumentHeap* arg, int64_t x, int64_t y, int64_t z )
 	{
-		return _dxUtils.get();
+		wait();
+		applyReload();
+
+		DX_ASSERT( 0 <= _dispatchConstantsIndex, "the shader doesn't include EzDx.hlsli" );
+		DX_ASSERT( x <= UINT32_MAX && y <= UINT32_MAX && z <= UINT32_MAX, "" );
+
+		const int64_t maxGroups = D3D12_CS_DISPATCH_MAX_THREAD_GROUPS_PER_DIMENSION;
+		int64_t threads[3] = { x, y, z };
+		int64_t groups[3];
+		DispatchConstants constants = dispatchConstants();
+		for( int i = 0; i < 3; ++i )
+		{
+			groups[i] = ( threads[i] + _groupSize[i] - 1 ) / _groupSize[i];
+			constants.threadCount[i] = (uint32_t)threads[i];
+		}
+
+		for( int64_t oz = 0; oz < groups[2]; oz += maxGroups )
+		for( int64_t oy = 0; oy < groups[1]; oy += maxGroups )
+		for( int64_t ox = 0; ox < groups[0]; ox += maxGroups )
+		{
+			constants.groupOffset[0] = (uint32_t)ox;
+			constants.groupOffset[1] = (uint32_t)oy;
+			constants.groupOffset[2] = (uint32_t)oz;
+			record( context, arg, constants,
+				std::min( groups[0] - ox, maxGroups ),
+				std::min( groups[1] - oy, maxGroups ),
+				std::min( groups[2] - oz, maxGroups ) );
+		}
 	}
-	IDxcCompiler3* dxCompiler()
+	void groupSize( int* x, int* y, int* z ) const
 	{
-		return _dxCompiler.get();
+		wait();
+		*x = _groupSize[0];
+		*y = _groupSize[1];
+		*z = _groupSize[2];
 	}
 private:
-	DxPtr<IDxcUtils> _dxUtils;
-	DxPtr<IDxcCompiler3> _dxCompiler;
-};
-enum class CompileMode
-{
-	Release,
-	Debug
-};
-
-class ArgumentHeap
-{
-public:
-	ArgumentHeap( ID3D12Device* device, std::map<std::string, int> var2index) :_var2index(var2index) {
-		HRESULT hr;
-		D3D12_DESCRIPTOR_HEAP_DESC desc = {};
-		desc.NumDescriptors = _var2index.size();
-		desc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
-		desc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-		hr = device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(_bufferHeap.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
-
-		_increment = device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-	
-		device->AddRef();
-		_device = DxPtr<ID3D12Device>(device);
+	Shader( DeviceObject *deviceObject, std::shared_ptr<ShaderSource> source, const char *includeDir, const CompileOptions& options )
+		: _deviceObject( deviceObject ), _filename( source->filename() ), _includeDir( includeDir ), _options( resolveTarget( deviceObject, options ) )
+	{
+		_build = CompileService::service().enqueue( [this, source]() {
+			ShaderBinary binary;
+			bool built = build( source.get(), &binary, &_dependencies );
+			DX_ASSERT( built, "" );
+			createPipeline( _deviceObject, binary.il.data(), binary.il.size(), binary.rootSignature.data(), binary.rootSignature.size(), binary.reflection );
+		} );
 	}
-	void RWStructured( const char *var, BufferResource *resource )
+
+	static CompileOptions resolveTarget( DeviceObject *deviceObject, const CompileOptions& options )
 	{
-		DX_ASSERT(_var2index.count(var), "");
-		D3D12_UNORDERED_ACCESS_VIEW_DESC d = resource->UAVDescription();
-		D3D12_CPU_DESCRIPTOR_HANDLE h = _bufferHeap->GetCPUDescriptorHandleForHeapStart();
-		h.ptr += _increment * _var2index[var];
-		_device->CreateUnorderedAccessView( resource->resource(), nullptr, &d, h );
+		CompileOptions resolved = options;
+		if( resolved.target.empty() )
+		{
+			resolved.target = deviceObject->computeTarget();
+		}
+		DX_ASSERT( !resolved.enable16BitTypes || deviceObject->native16BitShaderOps(), "the device does not support native 16-bit shader ops" );
+		return resolved;
 	}
-	template <class T>
-	void Constant( const char* var, ConstantBuffer<T>* resource )
+
+	// runs on a CompileService worker. false when the source has errors.
+	bool build( ShaderSource* shaderSource, ShaderBinary* binary, std::vector<IncludeDependency>* dependencies ) const
 	{
-		DX_ASSERT(_var2index.count(var), "");
-		D3D12_CONSTANT_BUFFER_VIEW_DESC d = {};
-		d.BufferLocation = resource->resource()->GetGPUVirtualAddress();
-		d.SizeInBytes = resource->bytes();
-		D3D12_CPU_DESCRIPTOR_HANDLE h = _bufferHeap->GetCPUDescriptorHandleForHeapStart();
-		h.ptr += _increment * _var2index[var];
-		_device->CreateConstantBufferView(&d, h);
+		const char* filename = shaderSource->filename().c_str();
+		std::wstring source = std::filesystem::path( filename ).filename().wstring();
+		std::vector<std::wstring> arguments = _options.arguments( source, pr::string_to_wstring( _includeDir ) );
+		std::vector<const wchar_t*> args;
+		for( const std::wstring& arg : arguments )
+		{
+			args.push_back( arg.c_str() );
+		}
+
+		// warm start. the recipe is known without reading the source, and the manifest tells whether any file it read has changed since.
+		Hash128 recipe = recipeKey( filename, args );
+
+		Hash128 cacheKey;
+		std::vector<uint8_t> cached;
+		if( ShaderCache::cache().loadDependencies( recipe, &cacheKey, dependencies ) &&
+			ShaderCache::cache().load( cacheKey, &cached ) &&
+			binary->deserialize( cached ) )
+		{
+			return true;
+		}
+		return compile( shaderSource, args, recipe, _options, binary, dependencies );
 	}
-	template <class T>
-	void ConstantGlobal(ConstantBuffer<T>* resource)
+
+	// runs on a CompileService worker
+	void reload()
 	{
-		Constant("$Globals", resource);
+		ShaderSource source( _filename );
+		std::vector<IncludeDependency> dependencies;
+		ShaderBinary binary;
+		if( build( &source, &binary, &dependencies ) )
+		{
+			std::unique_ptr<Pipeline> pipeline( new Pipeline() );
+			pipeline->layout = binary.reflection.rootSignature();
+			pipeline->reflection = binary.reflection;
+			createPipelineObjects( _deviceObject, binary.il.data(), binary.il.size(), binary.rootSignature.data(), binary.rootSignature.size(), &pipeline->signature, &pipeline->pipeline );
+			FileWatcher::watcher().update( _watch, dependencies );
+
+			std::lock_guard<std::mutex> lock( _reloadMutex );
+			_pending = std::move( pipeline );
+			_reloaded = true;
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lock( _reloadMutex );
+			_reloadError = _filename + " is not reloaded as it has errors";
+		}
+
+		std::lock_guard<std::mutex> lock( _reloadMutex );
+		if( _reloadAgain )
+		{
+			_reloadAgain = false;
+			_reload = CompileService::service().enqueue( [this]() { reload(); } );
+		}
+		else
+		{
+			_reloading = false;
+		}
 	}
-	ID3D12DescriptorHeap* descriptorHeap()
+
+	// the safe point of a reload. the old objects are released once the GPU is past the last submission that refers to them.
+	void applyReload()
 	{
-		return _bufferHeap.get();
+		if( !_watch )
+		{
+			return;
+		}
+		for( auto it = _retired.begin(); it != _retired.end(); )
+		{
+			it = _deviceObject->fence()->isComplete( it->fenceValue ) ? _retired.erase( it ) : it + 1;
+		}
+		if( !_reloaded || _pipelineUse.recording )
+		{
+			return;
+		}
+
+		std::unique_ptr<Pipeline> pipeline;
+		{
+			std::lock_guard<std::mutex> lock( _reloadMutex );
+			pipeline = std::move( _pending );
+			_reloaded = false;
+		}
+		if( !pipeline )
+		{
+			return;
+		}
+
+		// an error like the compile errors. the shader keeps the previous pipeline
+		bool compatible = pipeline->layout == _layout && pipeline->reflection.var2index() == _var2index;
+		{
+			std::lock_guard<std::mutex> lock( _reloadMutex );
+			_reloadError = compatible ? std::string() : _filename + " is not reloaded as the bindings changed";
+		}
+		if( !compatible )
+		{
+			return;
+		}
+
+		_retired.push_back( { _signature, _csPipeline, _pipelineUse.lastUse } );
+		_signature = pipeline->signature;
+		_csPipeline = pipeline->pipeline;
+		applyReflection( pipeline->reflection );
 	}
-private:
-	uint32_t _increment;
-	std::map<std::string, int> _var2index;
-	DxPtr<ID3D12DescriptorHeap> _bufferHeap;
-	DxPtr<ID3D12Device> _device;
-};
 
-class Shader
-{
-public:
-	Shader( DeviceObject *deviceObject, const char *filename, const char *includeDir, CompileMode compileMode )
+	// runs on a CompileService worker
+	void buildLinked( DeviceObject *deviceObject, const std::string& filename, const std::string& includeDir, const std::vector<std::shared_ptr<ShaderLibrary>>& libraries, const CompileOptions& options )
 	{
-		HRESULT hr;
-		DxPtr<IDxcIncludeHandler> pIncludeHandler;
-		hr = Compiler::compiler().dxUtils()->CreateDefaultIncludeHandler(pIncludeHandler.getAddressOf());
-		DX_ASSERT(hr == S_OK, "");
+		DxPtr<IDxcBlob> kernel = compileLibrary( filename, includeDir, options );
 
-		std::wstring I = pr::string_to_wstring(std::string(includeDir));
-		std::vector<const wchar_t*> args = {
-			L"simple.hlsl",
+		ShaderCacheKey link;
+		link.add( std::string( "link" ) );
+		link.add( Compiler::compiler().version() );
+		link.add( options.entryPoint );
+		link.add( options.target );
+		link.add( kernel->GetBufferPointer(), kernel->GetBufferSize() );
 
-			L"-T", L"cs_6_5",
-			L"-I", I.c_str(),
-		};
-		if( compileMode == CompileMode::Debug )
-		{
-			args.push_back(L"-Zi"); // Enable debug information
-			args.push_back(L"-Od"); // Disable optimizations
-			args.push_back(L"-Qembed_debug"); // Embed PDB in shader container (must be used with /Zi)
-		}
-
-		DxPtr<IDxcBlob> shaderFile( new DXCFileBlob( filename ) );
-		DX_ASSERT(shaderFile->GetBufferSize() != 0, "");
-
-		DxcBuffer buffer = { };
-		buffer.Ptr = shaderFile->GetBufferPointer();
-		buffer.Size = shaderFile->GetBufferSize();
-		buffer.Encoding = DXC_CP_ACP;
-		
-		std::string ilFile;
-		{
-			std::vector<const wchar_t*> args_preprocess = args;
-			args_preprocess.push_back(L"-P");
-			args_preprocess.push_back(L"preprocessed.hlsl");
-			DxPtr<IDxcResult> compileResult;
-			hr = Compiler::compiler().dxCompiler()->Compile(
-				&buffer,
-				args_preprocess.data(),
-				args_preprocess.size(),
-				pIncludeHandler.get(),
-				IID_PPV_ARGS(compileResult.getAddressOf()) // Compiler output status, buffer, and errors.
-			);
-			DX_ASSERT(hr == S_OK, "");
+		std::vector<IDxcBlob*> blobs = { kernel.get() };
+		for( const std::shared_ptr<ShaderLibrary>& library : libraries )
+		{
+			blobs.push_back( library->library() );
+			Hash128 hash = library->hash();
+			link.add( &hash, sizeof( hash ) );
+		}
+		Hash128 key = link.hash();
 
-			DxPtr<IDxcBlobUtf8> hlsl;
-			DxPtr<IDxcBlobUtf16> name;
-			hr = compileResult->GetOutput(DXC_OUT_HLSL, IID_PPV_ARGS(hlsl.getAddressOf()), name.getAddressOf());
+		ShaderBinary binary;
+		std::vector<uint8_t> cached;
+		if( !ShaderCache::cache().load( key, &cached ) || !binary.deserialize( cached ) )
+		{
+			DxPtr<IDxcBlob> ilBlob = linkShader( options.entryPoint, options.target, blobs );
+			binary = makeShaderBinary( ilBlob.get(), options );
+			std::vector<uint8_t> bytes = binary.serialize();
+			ShaderCache::cache().store( key, bytes.data(), bytes.size() );
+		}
 
-			if (hlsl && hlsl->GetBufferSize())
-			{
-				char shaderHash[9] = {};
-				uint32_t h = pr::xxhash32(hlsl->GetBufferPointer(), hlsl->GetBufferSize(), 0);
-				sprintf(shaderHash, "%08x", h);
+		createPipeline( deviceObject, binary.il.data(), binary.il.size(), binary.rootSignature.data(), binary.rootSignature.size(), binary.reflection );
+	}
 
-				std::string ilname = pr::GetPathBasenameWithoutExtension(filename) + "_" + shaderHash + ".il";
-				if (compileMode == CompileMode::Debug)
-				{
-					ilname += "_d";
-				}
-				ilFile = pr::JoinPath(pr::GetPathDirname(filename), ilname);
-			}
+	void createPipeline( DeviceObject *deviceObject, const void* il, size_t ilBytes, const void* rootSignature, size_t rootSignatureBytes, const ShaderReflection& reflection )
+	{
+		DX_ASSERT( !reflection.directlyIndexed || deviceObject->bindless(), "call DeviceObject::enableBindless() for shaders that use ResourceDescriptorHeap" );
+		_layout = reflection.rootSignature();
+		applyReflection( reflection );
+		createPipelineObjects( deviceObject, il, ilBytes, rootSignature, rootSignatureBytes, &_signature, &_csPipeline );
+	}
+	void applyReflection( const ShaderReflection& reflection )
+	{
+		_var2index = reflection.var2index();
+		_rootParameters = reflection.rootParameters();
+		_tableIndex = reflection.tableIndex();
+		_dispatchConstantsIndex = reflection.dispatchConstantsIndex();
+		_bindlessConstantsIndex = reflection.bindlessConstantsIndex();
+		for( int i = 0; i < 3; ++i )
+		{
+			_groupSize[i] = reflection.groupSize[i];
 		}
+	}
+	static void createPipelineObjects( DeviceObject *deviceObject, const void* il, size_t ilBytes, const void* rootSignature, size_t rootSignatureBytes, DxPtr<ID3D12RootSignature>* signature, DxPtr<ID3D12PipelineState>* csPipeline )
+	{
+		HRESULT hr;
+		hr = deviceObject->device()->CreateRootSignature(0, rootSignature, rootSignatureBytes, IID_PPV_ARGS(signature->getAddressOf()));
+		DX_ASSERT(hr == S_OK, "");
 
-		DxPtr<IDxcBlob> ilBlob;
-		DxPtr<IDxcBlob> ilBlobFromFile(new DXCFileBlob(ilFile.c_str()));
-		if( ilBlobFromFile->GetBufferSize() )
+		D3D12_COMPUTE_PIPELINE_STATE_DESC ppDesc = {};
+		ppDesc.CS.pShaderBytecode = il;
+		ppDesc.CS.BytecodeLength = ilBytes;
+		ppDesc.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+		ppDesc.NodeMask = 0;
+		ppDesc.pRootSignature = signature->get();
+		if( PipelineLibrary* library = deviceObject->pipelineLibrary() )
 		{
-			ilBlob = ilBlobFromFile;
+			*csPipeline = library->computePipeline( ppDesc, rootSignature, rootSignatureBytes );
 		}
 		else
 		{
-			DxPtr<IDxcResult> compileResult;
-			hr = Compiler::compiler().dxCompiler()->Compile(
-				&buffer,
-				args.data(),
-				args.size(),
-				pIncludeHandler.get(),
-				IID_PPV_ARGS(compileResult.getAddressOf()) // Compiler output status, buffer, and errors.
-			);
+			hr = deviceObject->device()->CreateComputePipelineState(&ppDesc, IID_PPV_ARGS(csPipeline->getAddressOf()));
 			DX_ASSERT(hr == S_OK, "");
+		}
+	}
 
-			DxPtr<IDxcBlobUtf8> compileErrors;
-			hr = compileResult->GetOutput(DXC_OUT_ERRORS, IID_PPV_ARGS(compileErrors.getAddressOf()), nullptr);
-			DX_ASSERT(hr == S_OK, "");
+	// compiles or loads the binary by the content of the preprocessed source, and records the dependency manifest for the next warm start.
+	// debug builds compile the original files so that the embedded PDB refers to them. false when the source has errors.
+	static bool compile( ShaderSource* source, const std::vector<const wchar_t*>& args, const Hash128& recipeKey, const CompileOptions& options, ShaderBinary* binary, std::vector<IncludeDependency>* dependencies )
+	{
+		if( source->file()->GetBufferSize() == 0 )
+		{
+			return false;
+		}
 
-			hr = compileResult->GetOutput(DXC_OUT_OBJECT, IID_PPV_ARGS(ilBlob.getAddressOf()), nullptr);
-			DX_ASSERT(hr == S_OK, "");
+		PreprocessResult preprocessed = source->preprocess( args );
 
-			if( compileErrors.get() && compileErrors->GetStringLength() != 0 )
+		Hash128 key;
+		std::vector<uint8_t> cached;
+		if( preprocessed.succeeded )
+		{
+			key = preprocessedKey( preprocessed.hlsl.get(), args );
+			ShaderCache::cache().storeDependencies( recipeKey, key, preprocessed.dependencies );
+			*dependencies = preprocessed.dependencies;
+			if( ShaderCache::cache().load( key, &cached ) && binary->deserialize( cached ) )
 			{
-				printf("Warnings and Errors:\n%s\n", compileErrors->GetStringPointer());
+				return true;
 			}
+		}
 
-			if( ilBlob && 0 < ilBlob->GetBufferSize() )
-			{
-				static std::random_device rd;
-				static std::mt19937 e { rd() };
-				static std::mutex m;
-				std::lock_guard<std::mutex> lock(m);
-				std::uniform_int_distribution<int> gen { 0, 23 };
-				char tmp[9] = {};
-				for (int i = 0; i < 8; ++i)
-				{
-					tmp[i] = 'a' + gen( e );
-				}
-				std::string tmpName = pr::GetPathBasenameWithoutExtension(filename) + "_" + tmp;
-				std::string tmpFile = pr::JoinPath(pr::GetPathDirname(filename), tmpName);
-
-				FILE* fp = fopen(tmpFile.c_str(), "wb");
-				fwrite(ilBlob->GetBufferPointer(), ilBlob->GetBufferSize(), 1, fp);
-				fclose(fp);
-				
-				if( rename(tmpFile.c_str(), ilFile.c_str()) != 0 )
-				{
-					remove(tmpFile.c_str());
-				}
-			}
-			else
-			{
-				DX_ASSERT(0, "");
-			}
+		auto beg = std::chrono::steady_clock::now();
+		IDxcBlob* input = preprocessed.succeeded && options.mode != CompileMode::Debug ? preprocessed.hlsl.get() : source->file();
+		DxPtr<IDxcBlob> ilBlob = tryCompileShader( input, args );
+		CompileService::service().recordKernel( std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - beg ).count() );
+		if( !ilBlob.get() )
+		{
+			return false;
 		}
-		
-		DxPtr<IDxcContainerReflection> reflectionContainer;
-		UINT32 shaderIdx;
-		hr = DxcCreateInstance(CLSID_DxcContainerReflection, IID_PPV_ARGS(reflectionContainer.getAddressOf()) );
-		DX_ASSERT(hr == S_OK, "");
-		hr = reflectionContainer->Load(ilBlob.get());
-		DX_ASSERT(hr == S_OK, "");
-		hr = reflectionContainer->FindFirstPartKind(MAKEFOURCC('D', 'X', 'I', 'L'), &shaderIdx);
-		DX_ASSERT(hr == S_OK, "");
 
-		DxPtr<ID3D12ShaderReflection> reflection;
-		hr = reflectionContainer->GetPartReflection(shaderIdx, IID_PPV_ARGS(reflection.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
+		*binary = makeShaderBinary( ilBlob.get(), options );
+		if( preprocessed.succeeded )
+		{
+			std::vector<uint8_t> bytes = binary->serialize();
+			ShaderCache::cache().store( key, bytes.data(), bytes.size() );
+		}
+		return true;
+	}
 
-		// Use reflection interface here.
-		D3D12_SHADER_DESC desc = {};
-		reflection->GetDesc(&desc);
+	DispatchConstants dispatchConstants() const
+	{
+		DispatchConstants constants = {};
+		constants.groupThreads = _groupSize[0] * _groupSize[1] * _groupSize[2];
+		for( int i = 0; i < 3; ++i )
+		{
+			constants.groupSize[i] = _groupSize[i];
+		}
+		return constants;
+	}
+	void record( CommandContext& context, ArgumentHeap* arg, const DispatchConstants& constants, int64_t x, int64_t y, int64_t z )
+	{
+		for( auto srv : arg->shaderResources() )
+		{
+			context.transition( srv.second, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE );
+		}
+		for( auto uav : arg->unorderedAccesses() )
+		{
+			context.beginUnorderedAccess( uav.second );
+		}
+		context.flushBarriers();
 
-		std::vector<D3D12_DESCRIPTOR_RANGE> bufferDescriptorRanges;
-		for (auto i = 0; i < desc.BoundResources; ++i)
+		context.setDescriptorHeap( arg->descriptorHeap() );
+		context.use( &_pipelineUse );
+		context.setPipelineState( _csPipeline.get() );
+		context.setComputeRootSignature( _signature.get() );
+		if( 0 <= _tableIndex )
 		{
-			D3D12_SHADER_INPUT_BIND_DESC bind = {};
-			reflection->GetResourceBindingDesc(i, &bind);
-			D3D12_DESCRIPTOR_RANGE range = {};
-			switch (bind.Type)
-			{
-			case D3D_SIT_CBUFFER:
-				range.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_CBV;
-				break;
-			case D3D_SIT_STRUCTURED:
-				range.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
-				break;
-			case D3D_SIT_UAV_RWTYPED:
-			case D3D_SIT_UAV_RWSTRUCTURED:
-				range.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV;
-				break;
-			default:
-				DX_ASSERT(0, "");
-			}
+			context.list()->SetComputeRootDescriptorTable( _tableIndex, arg->commit( context ) );
+		}
+		if( 0 <= _dispatchConstantsIndex )
+		{
+			context.list()->SetComputeRoot32BitConstants( _dispatchConstantsIndex, sizeof(DispatchConstants) / sizeof(uint32_t), &constants, 0 );
+		}
+		if( 0 <= _bindlessConstantsIndex )
+		{
+			context.list()->SetComputeRoot32BitConstants( _bindlessConstantsIndex, sizeof(BindlessConstants) / sizeof(uint32_t), &arg->bindlessConstants(), 0 );
+		}
+		arg->commitRoot( context );
+		context.list()->Dispatch( x, y, z );
 
-			range.NumDescriptors = 1;
-			range.BaseShaderRegister = bind.BindPoint;
-			range.RegisterSpace = bind.Space;
-			range.OffsetInDescriptorsFromTableStart = D3D12_DESCRIPTOR_RANGE_OFFSET_APPEND;
-			bufferDescriptorRanges.push_back(range);
-			_var2index[bind.Name] = i;
+		for( auto uav : arg->unorderedAccesses() )
+		{
+			context.endUnorderedAccess( uav.second );
 		}
+	}
+
+	DxPtr<ID3D12RootSignature> _signature;
+	DxPtr<ID3D12PipelineState> _csPipeline;
+	std::map<std::string, int> _var2index;
+	std::map<std::string, RootParameter> _rootParameters;
+	int _groupSize[3] = { 1, 1, 1 };
+	int _tableIndex = -1;
+	int _dispatchConstantsIndex = -1;
+	int _bindlessConstantsIndex = -1;
+
+	mutable std::shared_future<void> _build;
+	mutable std::mutex _buildMutex;
+	mutable std::atomic<bool> _ready { false };
+
+	// for reloads. empty unless built from a file
+	DeviceObject* _deviceObject = nullptr;
+	std::string _filename;
+	std::string _includeDir;
+	CompileOptions _options;
+	std::vector<IncludeDependency> _dependencies;
+	std::string _layout;
+
+	struct Pipeline
+	{
+		DxPtr<ID3D12RootSignature> signature;
+		DxPtr<ID3D12PipelineState> pipeline;
+		ShaderReflection reflection;
+		std::string layout;
+	};
+	struct Retired
+	{
+		DxPtr<ID3D12RootSignature> signature;
+		DxPtr<ID3D12PipelineState> pipeline;
+		uint64_t fenceValue;
+	};
+	uint64_t _watch = 0;
+	ResourceState _pipelineUse;
+	std::vector<Retired> _retired;
+	mutable std::mutex _reloadMutex;
+	std::future<void> _reload;
+	std::unique_ptr<Pipeline> _pending;
+	std::atomic<bool> _reloaded { false };
+	bool _reloading = false;
+	bool _reloadAgain = false;
+	std::string _reloadError;
+};
 
-		D3D12_ROOT_PARAMETER rootParameter = {};
-		rootParameter.ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
-		rootParameter.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL;
-		rootParameter.DescriptorTable.NumDescriptorRanges = bufferDescriptorRanges.size();
-		rootParameter.DescriptorTable.pDescriptorRanges = bufferDescriptorRanges.data();
+/*
+ Specializations of one source by preprocessor defines. Each distinct CompileOptions is built once,
+ on first request or by prebuild(), and shared afterwards. Compiled IL is kept across runs by ShaderCache.
+*/
+class ShaderVariants
+{
+public:
+	ShaderVariants( const ShaderVariants& ) = delete;
+	void operator=( const ShaderVariants& ) = delete;
 
-		// Signature
-		D3D12_ROOT_SIGNATURE_DESC rsDesc = CD3DX12_ROOT_SIGNATURE_DESC(1, &rootParameter);
-		DxPtr<ID3DBlob> signatureBlob;
-		hr = D3D12SerializeRootSignature(&rsDesc, D3D_ROOT_SIGNATURE_VERSION_1, signatureBlob.getAddressOf(), nullptr);
-		DX_ASSERT(hr == S_OK, "");
+	ShaderVariants( DeviceObject *deviceObject, const char *filename, const char *includeDir )
+		: _deviceObject( deviceObject ), _filename( filename ), _includeDir( includeDir )
+	{
+	}
+	ShaderVariants( DeviceObject *deviceObject, const ShaderPack* pack, const char* name )
+		: _deviceObject( deviceObject ), _pack( pack ), _filename( name )
+	{
+	}
 
-		hr = deviceObject->device()->CreateRootSignature(0, signatureBlob->GetBufferPointer(), signatureBlob->GetBufferSize(), IID_PPV_ARGS(_signature.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
+	// the returned shader may still be building. it lives as long as this object.
+	Shader* variant( const CompileOptions& options )
+	{
+		Hash128 key = options.hash();
 
-		D3D12_COMPUTE_PIPELINE_STATE_DESC ppDesc = {};
-		ppDesc.CS.pShaderBytecode = ilBlob->GetBufferPointer();
-		ppDesc.CS.BytecodeLength = ilBlob->GetBufferSize();
-		ppDesc.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
-		ppDesc.NodeMask = 0;
-		ppDesc.pRootSignature = _signature.get();
-		hr = deviceObject->device()->CreateComputePipelineState(&ppDesc, IID_PPV_ARGS(_csPipeline.getAddressOf()));
-		DX_ASSERT(hr == S_OK, "");
+		std::lock_guard<std::mutex> lock( _variantsMutex );
+		std::unique_ptr<Shader>& shader = _variants[key];
+		if( !shader )
+		{
+			if( _pack )
+			{
+				shader = std::unique_ptr<Shader>( new Shader( _deviceObject, _pack, _filename.c_str(), options ) );
+			}
+			else
+			{
+				shader = std::unique_ptr<Shader>( new Shader( _deviceObject, _filename.c_str(), _includeDir.c_str(), options ) );
+			}
+		}
+		return shader.get();
 	}
-	ArgumentHeap* createArgumentHeap( ID3D12Device* device ) const
+
+	// starts building every combination in the background
+	void prebuild( const DefinePermutations& permutations, const CompileOptions& base = CompileOptions() )
 	{
-		return new ArgumentHeap( device, _var2index );
+		for( const CompileOptions& options : permutations.enumerate( base ) )
+		{
+			variant( options );
+		}
 	}
 
-	// asynchronous
-	void dispatch( DeviceObject* deviceObject, ArgumentHeap* arg, int64_t x, int64_t y, int64_t z)
+	size_t count() const
 	{
-		deviceObject->executeCommand([&](ID3D12GraphicsCommandList* commandList) {
-			ID3D12DescriptorHeap* heap = arg->descriptorHeap();
-			commandList->SetDescriptorHeaps( 1, &heap );
-			commandList->SetPipelineState(_csPipeline.get());
-			commandList->SetComputeRootSignature(_signature.get());
-			commandList->SetComputeRootDescriptorTable( 0, heap->GetGPUDescriptorHandleForHeapStart() );
-			commandList->Dispatch( x, y, z );
-		});
+		std::lock_guard<std::mutex> lock( _variantsMutex );
+		return _variants.size();
 	}
 private:
-	DxPtr<ID3D12RootSignature> _signature;
-	DxPtr<ID3D12PipelineState> _csPipeline;
-	std::map<std::string, int> _var2index;
+	DeviceObject* _deviceObject;
+	const ShaderPack* _pack = nullptr;
+	std::string _filename;
+	std::string _includeDir;
+
+	std::map<Hash128, std::unique_ptr<Shader>> _variants;
+	mutable std::mutex _variantsMutex;
 };
 
 } // ezdx
\ No newline at end of file
@@ -0,0 +1,2450 @@
+#pragma once
+
+/*
+ The DXC facing part of EzDx. It doesn't depend on D3D12, so it also builds on Linux against libdxcompiler.so.
+ premake5 --dxc-linux=<dir> points the shaderpack project at an extracted DXC Linux release.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined( _WIN32 )
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef max
+#undef max
+#endif
+#ifdef min
+#undef min
+#endif
+
+#include "dxcapi.h"
+#include "d3d12shader.h"
+
+#if defined( _MSC_VER )
+#define EZDX_DEBUGBREAK() __debugbreak()
+#else
+#define EZDX_DEBUGBREAK() __builtin_trap()
+#endif
+
+#define DX_ASSERT( status, message )                                                             \
+	if ( ( status ) == 0 )                                                                       \
+	{                                                                                            \
+		char buffer[512];                                                                        \
+		snprintf( buffer, sizeof( buffer ), "%s, %s (%d line)\n", message, __FILE__, __LINE__ ); \
+		EZDX_DEBUGBREAK();                                                                       \
+	}
+
+namespace ezdx {
+
+template <class T>
+class DxPtr
+{
+public:
+	DxPtr() {}
+	DxPtr( T* ptr ) : _ptr( ptr )
+	{
+	}
+	DxPtr( const DxPtr<T>& rhs ) : _ptr( rhs._ptr )
+	{
+		if ( _ptr )
+		{
+			_ptr->AddRef();
+		}
+	}
+	DxPtr<T>& operator=( const DxPtr<T>& rhs )
+	{
+		auto p = _ptr;
+
+		if ( rhs._ptr )
+		{
+			rhs._ptr->AddRef();
+		}
+		_ptr = rhs._ptr;
+
+		if ( p )
+		{
+			p->Release();
+		}
+		return *this;
+	}
+	~DxPtr()
+	{
+		if ( _ptr )
+		{
+			_ptr->Release();
+		}
+	}
+	T* get()
+	{
+		return _ptr;
+	}
+	const T* get() const
+	{
+		return _ptr;
+	}
+	T* operator->()
+	{
+		return _ptr;
+	}
+	T** getAddressOf()
+	{
+		return &_ptr;
+	}
+	operator bool()
+	{
+		return _ptr != nullptr;
+	}
+
+private:
+	T* _ptr = nullptr;
+};
+
+inline int64_t alignedExpand( int64_t x, int64_t align )
+{
+	return ( ( x + align - 1 ) / align ) * align;
+}
+
+struct Hash128
+{
+	uint64_t lo = 0;
+	uint64_t hi = 0;
+
+	bool operator==( const Hash128& rhs ) const
+	{
+		return lo == rhs.lo && hi == rhs.hi;
+	}
+	bool operator<( const Hash128& rhs ) const
+	{
+		return hi < rhs.hi || ( hi == rhs.hi && lo < rhs.lo );
+	}
+	std::string toString() const
+	{
+		char s[33] = {};
+		snprintf( s, sizeof( s ), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo );
+		return s;
+	}
+};
+
+// MurmurHash3_x64_128
+inline Hash128 murmurHash3_128( const void* key, size_t bytes, uint32_t seed )
+{
+	auto rotl64 = []( uint64_t x, int r ) { return ( x << r ) | ( x >> ( 64 - r ) ); };
+	auto fmix64 = []( uint64_t k ) {
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	};
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+	const uint8_t* data = (const uint8_t*)key;
+	size_t nblocks = bytes / 16;
+	uint64_t h1 = seed;
+	uint64_t h2 = seed;
+	for( size_t i = 0; i < nblocks; ++i )
+	{
+		uint64_t k1, k2;
+		memcpy( &k1, data + i * 16, 8 );
+		memcpy( &k2, data + i * 16 + 8, 8 );
+
+		k1 *= c1; k1 = rotl64( k1, 31 ); k1 *= c2; h1 ^= k1;
+		h1 = rotl64( h1, 27 ); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64( k2, 33 ); k2 *= c1; h2 ^= k2;
+		h2 = rotl64( h2, 31 ); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const uint8_t* tail = data + nblocks * 16;
+	size_t rest = bytes & 15;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+	for( size_t i = 0; i < rest; ++i )
+	{
+		if( i < 8 )
+		{
+			k1 ^= (uint64_t)tail[i] << ( i * 8 );
+		}
+		else
+		{
+			k2 ^= (uint64_t)tail[i] << ( ( i - 8 ) * 8 );
+		}
+	}
+	if( 8 < rest )
+	{
+		k2 *= c2; k2 = rotl64( k2, 33 ); k2 *= c1; h2 ^= k2;
+	}
+	if( 0 < rest )
+	{
+		k1 *= c1; k1 = rotl64( k1, 31 ); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= bytes;
+	h2 ^= bytes;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64( h1 );
+	h2 = fmix64( h2 );
+	h1 += h2;
+	h2 += h1;
+
+	Hash128 h;
+	h.lo = h1;
+	h.hi = h2;
+	return h;
+}
+
+class ByteWriter
+{
+public:
+	void write( const void* p, size_t bytes )
+	{
+		const uint8_t* b = (const uint8_t*)p;
+		_bytes.insert( _bytes.end(), b, b + bytes );
+	}
+	template <class T>
+	void write( const T& value )
+	{
+		write( &value, sizeof( T ) );
+	}
+	template <class T>
+	void writeArray( const T* p, size_t count )
+	{
+		write( (uint32_t)count );
+		write( p, count * sizeof( T ) );
+	}
+	const std::vector<uint8_t>& bytes() const
+	{
+		return _bytes;
+	}
+private:
+	std::vector<uint8_t> _bytes;
+};
+
+// every read fails once the data runs out.
+class ByteReader
+{
+public:
+	ByteReader( const std::vector<uint8_t>& bytes ) : _bytes( bytes )
+	{
+	}
+	bool read( void* p, size_t bytes )
+	{
+		if( _bytes.size() - _cursor < bytes )
+		{
+			return false;
+		}
+		memcpy( p, _bytes.data() + _cursor, bytes );
+		_cursor += bytes;
+		return true;
+	}
+	template <class T>
+	bool read( T* value )
+	{
+		return read( value, sizeof( T ) );
+	}
+	template <class C>
+	bool readArray( C* container )
+	{
+		typedef typename C::value_type T;
+		uint32_t count;
+		if( !read( &count ) || ( _bytes.size() - _cursor ) / sizeof( T ) < count )
+		{
+			return false;
+		}
+		container->resize( count );
+		return read( container->data(), count * sizeof( T ) );
+	}
+private:
+	const std::vector<uint8_t>& _bytes;
+	size_t _cursor = 0;
+};
+
+class DXCFileBlob : public IDxcBlob
+{
+public:
+	DXCFileBlob( const char* file ):_counter(1)
+	{
+		FILE* fp = fopen( file, "rb" );
+		if( fp == 0 )
+		{
+			return;
+		}
+		fseek( fp, 0, SEEK_END );
+
+		_data.resize( ftell( fp ) );
+
+		fseek( fp, 0, SEEK_SET );
+
+		size_t s = fread( _data.data(), 1, _data.size(), fp );
+		DX_ASSERT( s == _data.size(), "failed to load file." );
+
+		fclose( fp );
+		fp = nullptr;
+	}
+	LPVOID STDMETHODCALLTYPE GetBufferPointer(void) override 
+	{
+		return _data.data();
+	}
+	SIZE_T STDMETHODCALLTYPE GetBufferSize(void) override
+	{
+		return _data.size();
+	}
+	virtual ULONG STDMETHODCALLTYPE AddRef(void)
+	{
+		ULONG c = _counter++;
+		return c + 1;
+	}
+	virtual ULONG STDMETHODCALLTYPE Release(void)
+	{
+		ULONG c = _counter--;
+		if (c - 1 == 0)
+		{
+			delete this;
+		}
+		return c - 1;
+	}
+
+	HRESULT STDMETHODCALLTYPE QueryInterface(
+		/* [in] */ REFIID riid,
+		/* [iid_is][out] */ _COM_Outptr_ void** ppvObject)
+	{
+		if ((riid == __uuidof(IDxcBlob)) || (riid == __uuidof(IUnknown)))
+		{
+			*ppvObject = (void*)this;
+			AddRef(); // -- Maintain the reference count
+		}
+		else
+			*ppvObject = NULL;
+
+		return (*ppvObject == NULL) ? E_NOINTERFACE : S_OK;
+	}
+private:
+	std::atomic<ULONG> _counter;
+	std::vector<uint8_t> _data;
+};
+
+
+/*
+ DXC instances are not meant to be shared between threads, so every thread gets its own.
+*/
+class Compiler
+{
+public:
+	Compiler()
+	{
+		HRESULT hr;
+		hr = DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(_dxUtils.getAddressOf()));
+		DX_ASSERT(hr == S_OK, "");
+		hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(_dxCompiler.getAddressOf()));
+		DX_ASSERT(hr == S_OK, "");
+	}
+	static Compiler& compiler()
+	{
+		static thread_local Compiler c;
+		return c;
+	}
+	IDxcUtils* dxUtils()
+	{
+		return _dxUtils.get();
+	}
+	IDxcCompiler3* dxCompiler()
+	{
+		return _dxCompiler.get();
+	}
+
+	// identifies the dxcompiler build. it is a part of the shader cache key.
+	const std::string& version()
+	{
+		std::call_once( _versionOnce, [&]() {
+			DxPtr<IDxcVersionInfo> info;
+			if( _dxCompiler->QueryInterface( IID_PPV_ARGS( info.getAddressOf() ) ) != S_OK )
+			{
+				_version = "unknown";
+				return;
+			}
+			UINT32 major = 0, minor = 0;
+			info->GetVersion( &major, &minor );
+			_version = std::to_string( major ) + "." + std::to_string( minor );
+
+			DxPtr<IDxcVersionInfo2> info2;
+			if( _dxCompiler->QueryInterface( IID_PPV_ARGS( info2.getAddressOf() ) ) == S_OK )
+			{
+				UINT32 commitCount = 0;
+				char* commitHash = nullptr;
+				if( info2->GetCommitInfo( &commitCount, &commitHash ) == S_OK )
+				{
+					_version += "." + std::to_string( commitCount ) + "-" + commitHash;
+					CoTaskMemFree( commitHash );
+				}
+			}
+		} );
+		return _version;
+	}
+private:
+	DxPtr<IDxcUtils> _dxUtils;
+	DxPtr<IDxcCompiler3> _dxCompiler;
+	std::once_flag _versionOnce;
+	std::string _version;
+};
+
+/*
+ Collects every compile input. Each input is length prefixed so that different splits never produce the same bytes.
+*/
+class ShaderCacheKey
+{
+public:
+	void add( const void* p, size_t bytes )
+	{
+		uint64_t n = bytes;
+		append( &n, sizeof( n ) );
+		append( p, bytes );
+	}
+	void add( const std::string& s )
+	{
+		add( s.data(), s.size() );
+	}
+	void add( const std::wstring& s )
+	{
+		add( s.data(), s.size() * sizeof( wchar_t ) );
+	}
+	Hash128 hash() const
+	{
+		return murmurHash3_128( _bytes.data(), _bytes.size(), 0 );
+	}
+private:
+	void append( const void* p, size_t bytes )
+	{
+		const uint8_t* b = (const uint8_t*)p;
+		_bytes.insert( _bytes.end(), b, b + bytes );
+	}
+	std::vector<uint8_t> _bytes;
+};
+
+/*
+ A file read while preprocessing a shader. The time is the raw file_time_type count.
+*/
+struct IncludeDependency
+{
+	std::wstring path;
+	int64_t bytes = 0;
+	int64_t time = 0;
+	Hash128 hash;
+
+	static IncludeDependency make( const std::wstring& path, const void* content, size_t bytes )
+	{
+		IncludeDependency d;
+		std::error_code ec;
+		d.path = std::filesystem::absolute( path, ec ).wstring();
+		d.bytes = bytes;
+		d.time = std::filesystem::last_write_time( d.path, ec ).time_since_epoch().count();
+		d.hash = murmurHash3_128( content, bytes, 0 );
+		return d;
+	}
+	// the current state of the file. a missing file is empty.
+	static IncludeDependency load( const std::wstring& path )
+	{
+		std::vector<char> content;
+		std::ifstream ifs( std::filesystem::path( path ), std::ios::binary );
+		if( ifs )
+		{
+			content.assign( std::istreambuf_iterator<char>( ifs ), std::istreambuf_iterator<char>() );
+		}
+		return make( path, content.data(), content.size() );
+	}
+	bool isUpToDate() const
+	{
+		std::error_code ec;
+		int64_t currentBytes = (int64_t)std::filesystem::file_size( path, ec );
+		if( ec || currentBytes != bytes )
+		{
+			return false;
+		}
+		int64_t currentTime = std::filesystem::last_write_time( path, ec ).time_since_epoch().count();
+		if( ec )
+		{
+			return false;
+		}
+		if( currentTime == time )
+		{
+			return true;
+		}
+
+		// touched but possibly unchanged
+		std::vector<char> content( bytes );
+		std::ifstream ifs( std::filesystem::path( path ), std::ios::binary );
+		if( !ifs.read( content.data(), content.size() ) )
+		{
+			return false;
+		}
+		return murmurHash3_128( content.data(), content.size(), 0 ) == hash;
+	}
+};
+
+/*
+ Forwards to another include handler and records every file it loads.
+*/
+class RecordingIncludeHandler : public IDxcIncludeHandler
+{
+public:
+	RecordingIncludeHandler( IDxcIncludeHandler* base ) : _counter( 1 )
+	{
+		base->AddRef();
+		_base = DxPtr<IDxcIncludeHandler>( base );
+	}
+	HRESULT STDMETHODCALLTYPE LoadSource( _In_z_ LPCWSTR pFilename, _COM_Outptr_result_maybenull_ IDxcBlob** ppIncludeSource ) override
+	{
+		HRESULT hr = _base->LoadSource( pFilename, ppIncludeSource );
+		if( hr == S_OK && *ppIncludeSource )
+		{
+			record( pFilename, ( *ppIncludeSource )->GetBufferPointer(), ( *ppIncludeSource )->GetBufferSize() );
+		}
+		return hr;
+	}
+	void record( const std::wstring& path, const void* content, size_t bytes )
+	{
+		IncludeDependency d = IncludeDependency::make( path, content, bytes );
+		for( const IncludeDependency& recorded : _dependencies )
+		{
+			if( recorded.path == d.path )
+			{
+				return;
+			}
+		}
+		_dependencies.push_back( d );
+	}
+	const std::vector<IncludeDependency>& dependencies() const
+	{
+		return _dependencies;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE AddRef(void)
+	{
+		ULONG c = _counter++;
+		return c + 1;
+	}
+	virtual ULONG STDMETHODCALLTYPE Release(void)
+	{
+		ULONG c = _counter--;
+		if (c - 1 == 0)
+		{
+			delete this;
+		}
+		return c - 1;
+	}
+	HRESULT STDMETHODCALLTYPE QueryInterface(
+		/* [in] */ REFIID riid,
+		/* [iid_is][out] */ _COM_Outptr_ void** ppvObject)
+	{
+		if ((riid == __uuidof(IDxcIncludeHandler)) || (riid == __uuidof(IUnknown)))
+		{
+			*ppvObject = (void*)this;
+			AddRef(); // -- Maintain the reference count
+		}
+		else
+			*ppvObject = NULL;
+
+		return (*ppvObject == NULL) ? E_NOINTERFACE : S_OK;
+	}
+private:
+	std::atomic<ULONG> _counter;
+	DxPtr<IDxcIncludeHandler> _base;
+	std::vector<IncludeDependency> _dependencies;
+};
+
+struct ShaderCacheStatistics
+{
+	int64_t hits = 0;
+	int64_t misses = 0;
+	int64_t writes = 0;
+	int64_t evictions = 0;
+	int64_t preprocessSkips = 0;
+};
+
+/*
+ Content addressed store of compiled shaders shared by all processes that point at the same directory.
+ Files are written to a temporary name and renamed into place, so a reader never sees a partial file.
+ A hit refreshes the modification time and the least recently used files are evicted beyond maxBytes.
+*/
+class ShaderCache
+{
+public:
+	ShaderCache( const ShaderCache& ) = delete;
+	void operator=( const ShaderCache& ) = delete;
+
+	ShaderCache()
+	{
+		std::error_code ec;
+		setDirectory( ( std::filesystem::temp_directory_path( ec ) / "EzDxShaderCache" ).string() );
+	}
+	static ShaderCache& cache()
+	{
+		static ShaderCache c;
+		return c;
+	}
+
+	void setDirectory( const std::string& directory )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_directory = directory;
+		std::error_code ec;
+		std::filesystem::create_directories( _directory, ec );
+	}
+	std::string directory() const
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		return _directory;
+	}
+	void setMaxBytes( int64_t bytes )
+	{
+		_maxBytes = bytes;
+	}
+	int64_t maxBytes() const
+	{
+		return _maxBytes;
+	}
+
+	bool load( const Hash128& key, std::vector<uint8_t>* data )
+	{
+		if( read( path( key, ILExtension ), key, data ) )
+		{
+			_hits++;
+			return true;
+		}
+		_misses++;
+		return false;
+	}
+
+	void store( const Hash128& key, const void* data, size_t bytes )
+	{
+		if( write( path( key, ILExtension ), key, data, bytes ) )
+		{
+			_writes++;
+			evict( _maxBytes );
+		}
+	}
+
+	/*
+	 The dependency manifest maps a recipe key, which is known without touching the source, to the key of the IL.
+	 It is valid as long as every file that was read while preprocessing is unchanged.
+	 A file is checked by size and modification time first and its content is hashed only when they differ.
+	*/
+	bool loadDependencies( const Hash128& recipeKey, Hash128* key, std::vector<IncludeDependency>* dependencies = nullptr )
+	{
+		if( dependencies )
+		{
+			dependencies->clear();
+		}
+		std::vector<uint8_t> data;
+		if( !read( path( recipeKey, DependencyExtension ), recipeKey, &data ) )
+		{
+			return false;
+		}
+
+		ByteReader reader( data );
+		uint32_t count = 0;
+		if( !reader.read( key ) || !reader.read( &count ) )
+		{
+			return false;
+		}
+		for( uint32_t i = 0; i < count; ++i )
+		{
+			IncludeDependency dependency;
+			if( !reader.readArray( &dependency.path ) ||
+				!reader.read( &dependency.bytes ) ||
+				!reader.read( &dependency.time ) ||
+				!reader.read( &dependency.hash ) )
+			{
+				return false;
+			}
+			if( !dependency.isUpToDate() )
+			{
+				return false;
+			}
+			if( dependencies )
+			{
+				dependencies->push_back( dependency );
+			}
+		}
+		_preprocessSkips++;
+		return true;
+	}
+	void storeDependencies( const Hash128& recipeKey, const Hash128& key, const std::vector<IncludeDependency>& dependencies )
+	{
+		ByteWriter writer;
+		writer.write( key );
+		writer.write( (uint32_t)dependencies.size() );
+		for( const IncludeDependency& dependency : dependencies )
+		{
+			writer.writeArray( dependency.path.data(), dependency.path.size() );
+			writer.write( dependency.bytes );
+			writer.write( dependency.time );
+			writer.write( dependency.hash );
+		}
+		write( path( recipeKey, DependencyExtension ), recipeKey, writer.bytes().data(), writer.bytes().size() );
+	}
+
+	// removes the least recently used entries until the total size is at most maxBytes.
+	void evict( int64_t maxBytes )
+	{
+		struct Entry
+		{
+			std::filesystem::path path;
+			int64_t bytes;
+			std::filesystem::file_time_type time;
+		};
+		std::vector<Entry> entries;
+		int64_t total = 0;
+
+		std::lock_guard<std::mutex> lock( _mutex );
+		std::error_code ec;
+		for( std::filesystem::directory_iterator it( _directory, ec ), end; !ec && it != end; it.increment( ec ) )
+		{
+			if( it->path().extension() != ILExtension && it->path().extension() != DependencyExtension )
+			{
+				continue;
+			}
+			std::error_code e;
+			Entry entry;
+			entry.path = it->path();
+			entry.bytes = (int64_t)it->file_size( e );
+			entry.time = it->last_write_time( e );
+			if( e )
+			{
+				continue;
+			}
+			total += entry.bytes;
+			entries.push_back( entry );
+		}
+		if( total <= maxBytes )
+		{
+			return;
+		}
+
+		std::sort( entries.begin(), entries.end(), []( const Entry& a, const Entry& b ) { return a.time < b.time; } );
+		for( const Entry& entry : entries )
+		{
+			if( total <= maxBytes )
+			{
+				break;
+			}
+			if( std::filesystem::remove( entry.path, ec ) )
+			{
+				total -= entry.bytes;
+				_evictions++;
+			}
+		}
+	}
+
+	ShaderCacheStatistics statistics() const
+	{
+		ShaderCacheStatistics s;
+		s.hits = _hits;
+		s.misses = _misses;
+		s.writes = _writes;
+		s.evictions = _evictions;
+		s.preprocessSkips = _preprocessSkips;
+		return s;
+	}
+private:
+	enum
+	{
+		Magic = 0x43535a45, // "EZSC"
+		Version = 7,
+	};
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		Hash128 key;
+		uint64_t bytes;
+	};
+	static constexpr const char* ILExtension = ".il";
+	static constexpr const char* DependencyExtension = ".dep";
+
+	std::filesystem::path path( const Hash128& key, const char* extension ) const
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		return std::filesystem::path( _directory ) / ( key.toString() + extension );
+	}
+	bool read( const std::filesystem::path& file, const Hash128& key, std::vector<uint8_t>* data )
+	{
+		bool found = false;
+		FILE* fp = fopen( file.string().c_str(), "rb" );
+		if( fp )
+		{
+			Header header = {};
+			if( fread( &header, sizeof( header ), 1, fp ) == 1 &&
+				header.magic == Magic && header.version == Version && header.key == key )
+			{
+				data->resize( header.bytes );
+				found = fread( data->data(), 1, data->size(), fp ) == data->size();
+			}
+			fclose( fp );
+		}
+		if( found )
+		{
+			// for LRU eviction
+			std::error_code ec;
+			std::filesystem::last_write_time( file, std::filesystem::file_time_type::clock::now(), ec );
+		}
+		return found;
+	}
+	bool write( const std::filesystem::path& file, const Hash128& key, const void* data, size_t bytes )
+	{
+		std::filesystem::path tmpFile = file;
+		tmpFile += "." + uniqueSuffix() + ".tmp";
+
+		FILE* fp = fopen( tmpFile.string().c_str(), "wb" );
+		if( fp == nullptr )
+		{
+			return false;
+		}
+		Header header = {};
+		header.magic = Magic;
+		header.version = Version;
+		header.key = key;
+		header.bytes = bytes;
+		bool written = fwrite( &header, sizeof( header ), 1, fp ) == 1 &&
+					   fwrite( data, 1, bytes, fp ) == bytes;
+		written = fclose( fp ) == 0 && written;
+
+		std::error_code ec;
+		if( written )
+		{
+			// replaces atomically. another process may have stored the same content in the meantime.
+			std::filesystem::rename( tmpFile, file, ec );
+		}
+		if( !written || ec )
+		{
+			std::filesystem::remove( tmpFile, ec );
+			return false;
+		}
+		return true;
+	}
+	static std::string uniqueSuffix()
+	{
+		static std::random_device rd;
+		static std::mt19937 e { rd() };
+		static std::mutex m;
+		std::lock_guard<std::mutex> lock( m );
+		std::uniform_int_distribution<int> gen { 0, 25 };
+		char tmp[9] = {};
+		for( int i = 0; i < 8; ++i )
+		{
+			tmp[i] = 'a' + gen( e );
+		}
+		return tmp;
+	}
+
+	mutable std::mutex _mutex;
+	std::string _directory;
+	std::atomic<int64_t> _maxBytes { 256 * 1024 * 1024 };
+	std::atomic<int64_t> _hits { 0 };
+	std::atomic<int64_t> _misses { 0 };
+	std::atomic<int64_t> _writes { 0 };
+	std::atomic<int64_t> _evictions { 0 };
+	std::atomic<int64_t> _preprocessSkips { 0 };
+};
+
+enum class CompileMode
+{
+	Release,
+	Debug
+};
+
+/*
+ Everything that selects a variant of a shader source besides the include directory.
+*/
+struct CompileOptions
+{
+	CompileOptions( CompileMode mode = CompileMode::Release ) : mode( mode )
+	{
+	}
+	CompileOptions& define( const std::string& name, const std::string& value = "1" )
+	{
+		defines[name] = value;
+		return *this;
+	}
+
+	// the source name is only used for messages
+	std::vector<std::wstring> arguments( const std::wstring& sourceName, const std::wstring& includeDir ) const
+	{
+		DX_ASSERT( !target.empty(), "the target has to be resolved before compiling" );
+		DX_ASSERT( 0 <= optimizationLevel && optimizationLevel <= 3, "" );
+
+		std::vector<std::wstring> args = {
+			sourceName,
+
+			L"-T", std::wstring( target.begin(), target.end() ),
+			L"-I", includeDir,
+		};
+		if( !entryPoint.empty() )
+		{
+			args.push_back( L"-E" );
+			args.push_back( std::wstring( entryPoint.begin(), entryPoint.end() ) );
+		}
+		if( mode == CompileMode::Debug )
+		{
+			args.push_back(L"-Zi"); // Enable debug information
+			args.push_back(L"-Od"); // Disable optimizations
+			args.push_back(L"-Qembed_debug"); // Embed PDB in shader container (must be used with /Zi)
+		}
+		else
+		{
+			args.push_back( L"-O" + std::to_wstring( optimizationLevel ) );
+		}
+		if( enable16BitTypes )
+		{
+			args.push_back( L"-enable-16bit-types" );
+		}
+		if( hlslVersion != 0 )
+		{
+			args.push_back( L"-HV" );
+			args.push_back( std::to_wstring( hlslVersion ) );
+		}
+		for( const std::string& flag : flags )
+		{
+			args.push_back( std::wstring( flag.begin(), flag.end() ) );
+		}
+
+		// unused by the compiler. they are arguments so that every cache key covers the root signature layout.
+		if( rootConstantBudget != 0 )
+		{
+			args.push_back( L"-D" );
+			args.push_back( L"EZDX_ROOT_CONSTANT_BUDGET=" + std::to_wstring( rootConstantBudget ) );
+		}
+		for( const std::string& name : rootDescriptors )
+		{
+			args.push_back( L"-D" );
+			args.push_back( L"EZDX_ROOT_DESCRIPTOR_" + std::wstring( name.begin(), name.end() ) );
+		}
+
+		for( const auto& d : defines )
+		{
+			std::string define = d.first + "=" + d.second;
+			args.push_back( L"-D" );
+			args.push_back( std::wstring( define.begin(), define.end() ) );
+		}
+		return args;
+	}
+
+	// identifies the variant of a source
+	Hash128 hash() const
+	{
+		ShaderCacheKey key;
+		key.add( &mode, sizeof( mode ) );
+		key.add( entryPoint );
+		key.add( target );
+		key.add( &optimizationLevel, sizeof( optimizationLevel ) );
+		key.add( &enable16BitTypes, sizeof( enable16BitTypes ) );
+		key.add( &hlslVersion, sizeof( hlslVersion ) );
+		for( const std::string& flag : flags )
+		{
+			key.add( flag );
+		}
+		key.add( &rootConstantBudget, sizeof( rootConstantBudget ) );
+		for( const std::string& name : rootDescriptors )
+		{
+			key.add( name );
+		}
+		for( const auto& d : defines )
+		{
+			key.add( d.first );
+			key.add( d.second );
+		}
+		return key.hash();
+	}
+
+	CompileMode mode;
+
+	// empty for library targets
+	std::string entryPoint = "main";
+
+	// empty selects the highest compute target of the device the shader is created on
+	std::string target = "cs_6_5";
+
+	// -O0 to -O3. ignored by CompileMode::Debug
+	int optimizationLevel = 3;
+
+	// native 16-bit types for min16float and friends. needs cs_6_2 and Native16BitShaderOpsSupported
+	bool enable16BitTypes = false;
+
+	// -HV, e.g. 2021. 0 leaves the compiler default
+	int hlslVersion = 0;
+
+	// passed to DXC as they are, after the flags above
+	std::vector<std::string> flags;
+
+	// DWORDs of root constants that small cbuffers are promoted to, in binding order. set them with ArgumentHeap::Inline()
+	int rootConstantBudget = 0;
+
+	// cbuffers, structured buffers and raw buffers bound as root CBV, SRV or UAV instead of through the table. root descriptors have no bounds checking
+	std::set<std::string> rootDescriptors;
+
+	// sorted, so the same set of defines always produces the same arguments
+	std::map<std::string, std::string> defines;
+};
+
+/*
+ Values per define. enumerate() returns every combination on top of a base.
+*/
+class DefinePermutations
+{
+public:
+	DefinePermutations& add( const std::string& name, const std::vector<std::string>& values )
+	{
+		_axes.push_back( std::make_pair( name, values ) );
+		return *this;
+	}
+	std::vector<CompileOptions> enumerate( const CompileOptions& base = CompileOptions() ) const
+	{
+		std::vector<CompileOptions> permutations( 1, base );
+		for( const auto& axis : _axes )
+		{
+			std::vector<CompileOptions> expanded;
+			for( const CompileOptions& options : permutations )
+			{
+				for( const std::string& value : axis.second )
+				{
+					CompileOptions o = options;
+					o.define( axis.first, value );
+					expanded.push_back( o );
+				}
+			}
+			permutations = expanded;
+		}
+		return permutations;
+	}
+private:
+	std::vector<std::pair<std::string, std::vector<std::string>>> _axes;
+};
+
+/*
+ Root constants of the EzDxDispatch cbuffer declared in EzDx.hlsli. Keep the layout in sync.
+*/
+struct DispatchConstants
+{
+	uint32_t groupOffset[3];
+	uint32_t foldWidth;
+	uint32_t threadCount[3];
+	uint32_t groupThreads;
+	uint32_t groupSize[3];
+	uint32_t foldRows;
+	uint32_t linearGroupBase[2];
+	uint32_t linearThreadCount[2];
+};
+
+/*
+ Root constants of the EzDxBindless cbuffer declared in EzDx.hlsli. Indices into ResourceDescriptorHeap.
+*/
+struct BindlessConstants
+{
+	uint32_t indices[16];
+};
+
+// the first three are in the descriptor table, the rest are root parameters
+enum class ShaderBindingType : uint32_t
+{
+	CBV,
+	SRV,
+	UAV,
+	RootConstants,
+	RootCBV,
+	RootSRV,
+	RootUAV,
+};
+
+struct ShaderBinding
+{
+	std::string name;
+	ShaderBindingType type = ShaderBindingType::CBV;
+	uint32_t bindPoint = 0;
+	uint32_t space = 0;
+	uint32_t bytes = 0; // cbuffer only
+	bool typed = false; // typed buffers cannot be root descriptors
+};
+
+struct RootParameter
+{
+	ShaderBindingType type = ShaderBindingType::RootConstants;
+	int index = -1;
+	uint32_t num32BitValues = 0; // RootConstants only
+};
+
+/*
+ What Shader needs from the reflection. Bindings become one descriptor table in this order,
+ and the EzDxDispatch cbuffer becomes root constants after the table.
+*/
+struct ShaderReflection
+{
+	int groupSize[3] = { 1, 1, 1 };
+	std::vector<ShaderBinding> bindings;
+	bool hasDispatchConstants = false;
+	uint32_t dispatchConstantsBindPoint = 0;
+	uint32_t dispatchConstantsSpace = 0;
+	bool hasBindlessConstants = false;
+	uint32_t bindlessConstantsBindPoint = 0;
+	uint32_t bindlessConstantsSpace = 0;
+
+	// the shader reads ResourceDescriptorHeap
+	bool directlyIndexed = false;
+
+	static bool inTable( ShaderBindingType type )
+	{
+		return type == ShaderBindingType::CBV || type == ShaderBindingType::SRV || type == ShaderBindingType::UAV;
+	}
+	bool hasTable() const
+	{
+		return std::any_of( bindings.begin(), bindings.end(), []( const ShaderBinding& b ) { return inTable( b.type ); } );
+	}
+	int tableIndex() const
+	{
+		return hasTable() ? 0 : -1;
+	}
+	int dispatchConstantsIndex() const
+	{
+		if( !hasDispatchConstants )
+		{
+			return -1;
+		}
+		return hasTable() ? 1 : 0;
+	}
+	int bindlessConstantsIndex() const
+	{
+		if( !hasBindlessConstants )
+		{
+			return -1;
+		}
+		return ( hasTable() ? 1 : 0 ) + ( hasDispatchConstants ? 1 : 0 );
+	}
+
+	// the slots of the descriptor table
+	std::map<std::string, int> var2index() const
+	{
+		std::map<std::string, int> m;
+		for( const ShaderBinding& b : bindings )
+		{
+			if( inTable( b.type ) )
+			{
+				int index = (int)m.size();
+				m[b.name] = index;
+			}
+		}
+		return m;
+	}
+
+	// the bindings outside of the table. they follow the table and the EzDx constants.
+	std::map<std::string, RootParameter> rootParameters() const
+	{
+		int index = ( hasTable() ? 1 : 0 ) + ( hasDispatchConstants ? 1 : 0 ) + ( hasBindlessConstants ? 1 : 0 );
+		std::map<std::string, RootParameter> m;
+		for( const ShaderBinding& b : bindings )
+		{
+			if( inTable( b.type ) )
+			{
+				continue;
+			}
+			RootParameter p;
+			p.type = b.type;
+			p.index = index++;
+			p.num32BitValues = b.type == ShaderBindingType::RootConstants ? ( b.bytes + 3 ) / 4 : 0;
+			m[b.name] = p;
+		}
+		return m;
+	}
+
+	// named buffers become root descriptors. then cbuffers become root constants in binding order while they fit in the budget.
+	// the other cbuffers become root CBVs while the root signature has space, so that a dispatch binds the address of its own copy of the constants.
+	void assignRootParameters( int rootConstantBudget, const std::set<std::string>& rootDescriptors )
+	{
+		// a root signature is limited to 64 DWORDs. a table costs 1, a root descriptor 2 and a constant 1.
+		int used = 1 + ( hasDispatchConstants ? 16 : 0 ) + ( hasBindlessConstants ? 16 : 0 );
+		for( ShaderBinding& b : bindings )
+		{
+			if( !rootDescriptors.count( b.name ) )
+			{
+				continue;
+			}
+			DX_ASSERT( !b.typed, "a root descriptor has to be a structured or raw buffer" );
+			switch( b.type )
+			{
+			case ShaderBindingType::CBV:
+				b.type = ShaderBindingType::RootCBV;
+				break;
+			case ShaderBindingType::SRV:
+				b.type = ShaderBindingType::RootSRV;
+				break;
+			case ShaderBindingType::UAV:
+				b.type = ShaderBindingType::RootUAV;
+				break;
+			default:
+				DX_ASSERT( 0, "" );
+				break;
+			}
+			used += 2;
+		}
+		DX_ASSERT( used <= 64, "the root signature is larger than 64 DWORDs" );
+
+		int budget = std::min( rootConstantBudget, 64 - used );
+		for( ShaderBinding& b : bindings )
+		{
+			int num32BitValues = ( b.bytes + 3 ) / 4;
+			if( b.type == ShaderBindingType::CBV && num32BitValues <= budget )
+			{
+				b.type = ShaderBindingType::RootConstants;
+				budget -= num32BitValues;
+				used += num32BitValues;
+			}
+		}
+
+		for( ShaderBinding& b : bindings )
+		{
+			if( b.type == ShaderBindingType::CBV && used + 2 <= 64 )
+			{
+				b.type = ShaderBindingType::RootCBV;
+				used += 2;
+			}
+		}
+	}
+
+	// in the HLSL root signature language
+	std::string rootSignature() const
+	{
+		char buffer[128];
+		std::string rs;
+		if( directlyIndexed )
+		{
+			rs += "RootFlags(CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED)";
+		}
+		if( hasTable() )
+		{
+			rs += rs.empty() ? "DescriptorTable(" : ", DescriptorTable(";
+			bool first = true;
+			for( const ShaderBinding& b : bindings )
+			{
+				if( !inTable( b.type ) )
+				{
+					continue;
+				}
+				snprintf( buffer, sizeof( buffer ), parameterFormat( b.type ), b.bindPoint, b.space );
+				rs += ( first ? "" : ", " ) + std::string( buffer );
+				first = false;
+			}
+			rs += ")";
+		}
+		if( hasDispatchConstants )
+		{
+			snprintf( buffer, sizeof( buffer ), "RootConstants(num32BitConstants=%d, b%u, space=%u)", (int)( sizeof( DispatchConstants ) / sizeof( uint32_t ) ), dispatchConstantsBindPoint, dispatchConstantsSpace );
+			rs += ( rs.empty() ? "" : ", " ) + std::string( buffer );
+		}
+		if( hasBindlessConstants )
+		{
+			snprintf( buffer, sizeof( buffer ), "RootConstants(num32BitConstants=%d, b%u, space=%u)", (int)( sizeof( BindlessConstants ) / sizeof( uint32_t ) ), bindlessConstantsBindPoint, bindlessConstantsSpace );
+			rs += ( rs.empty() ? "" : ", " ) + std::string( buffer );
+		}
+
+		// in the order of rootParameters()
+		for( const ShaderBinding& b : bindings )
+		{
+			if( inTable( b.type ) )
+			{
+				continue;
+			}
+			if( b.type == ShaderBindingType::RootConstants )
+			{
+				snprintf( buffer, sizeof( buffer ), "RootConstants(num32BitConstants=%u, b%u, space=%u)", ( b.bytes + 3 ) / 4, b.bindPoint, b.space );
+			}
+			else
+			{
+				snprintf( buffer, sizeof( buffer ), parameterFormat( b.type ), b.bindPoint, b.space );
+			}
+			rs += ( rs.empty() ? "" : ", " ) + std::string( buffer );
+		}
+		return rs;
+	}
+	static const char* parameterFormat( ShaderBindingType type )
+	{
+		switch( type )
+		{
+		case ShaderBindingType::CBV:
+		case ShaderBindingType::RootCBV:
+			return "CBV(b%u, space=%u)";
+		case ShaderBindingType::SRV:
+		case ShaderBindingType::RootSRV:
+			return "SRV(t%u, space=%u)";
+		case ShaderBindingType::UAV:
+		case ShaderBindingType::RootUAV:
+			return "UAV(u%u, space=%u)";
+		default:
+			return "";
+		}
+	}
+
+	void write( ByteWriter* writer ) const
+	{
+		writer->write( groupSize );
+		writer->write( (uint32_t)hasDispatchConstants );
+		writer->write( dispatchConstantsBindPoint );
+		writer->write( dispatchConstantsSpace );
+		writer->write( (uint32_t)hasBindlessConstants );
+		writer->write( bindlessConstantsBindPoint );
+		writer->write( bindlessConstantsSpace );
+		writer->write( (uint32_t)directlyIndexed );
+		writer->write( (uint32_t)bindings.size() );
+		for( const ShaderBinding& b : bindings )
+		{
+			writer->writeArray( b.name.data(), b.name.size() );
+			writer->write( b.type );
+			writer->write( b.bindPoint );
+			writer->write( b.space );
+			writer->write( b.bytes );
+			writer->write( (uint32_t)b.typed );
+		}
+	}
+	bool read( ByteReader* reader )
+	{
+		uint32_t dispatchConstants = 0;
+		uint32_t bindlessConstants = 0;
+		uint32_t heapIndexing = 0;
+		uint32_t count = 0;
+		if( !reader->read( &groupSize ) ||
+			!reader->read( &dispatchConstants ) ||
+			!reader->read( &dispatchConstantsBindPoint ) ||
+			!reader->read( &dispatchConstantsSpace ) ||
+			!reader->read( &bindlessConstants ) ||
+			!reader->read( &bindlessConstantsBindPoint ) ||
+			!reader->read( &bindlessConstantsSpace ) ||
+			!reader->read( &heapIndexing ) ||
+			!reader->read( &count ) )
+		{
+			return false;
+		}
+		hasDispatchConstants = dispatchConstants != 0;
+		hasBindlessConstants = bindlessConstants != 0;
+		directlyIndexed = heapIndexing != 0;
+		bindings.resize( count );
+		for( ShaderBinding& b : bindings )
+		{
+			uint32_t typed = 0;
+			if( !reader->readArray( &b.name ) ||
+				!reader->read( &b.type ) ||
+				!reader->read( &b.bindPoint ) ||
+				!reader->read( &b.space ) ||
+				!reader->read( &b.bytes ) ||
+				!reader->read( &typed ) )
+			{
+				return false;
+			}
+			b.typed = typed != 0;
+		}
+		return true;
+	}
+};
+
+/*
+ A compiled shader with everything derived from its reflection.
+ This is what the shader cache and the shader pack store, so loading needs neither DXC nor the reflection interfaces.
+*/
+struct ShaderBinary
+{
+	std::vector<uint8_t> il;
+	std::vector<uint8_t> rootSignature;
+	ShaderReflection reflection;
+
+	std::vector<uint8_t> serialize() const
+	{
+		ByteWriter writer;
+		writer.writeArray( il.data(), il.size() );
+		writer.writeArray( rootSignature.data(), rootSignature.size() );
+		reflection.write( &writer );
+		return writer.bytes();
+	}
+	bool deserialize( const std::vector<uint8_t>& bytes )
+	{
+		ByteReader reader( bytes );
+		if( !reader.readArray( &il ) ||
+			!reader.readArray( &rootSignature ) ||
+			!reflection.read( &reader ) )
+		{
+			return false;
+		}
+		return !il.empty() && !rootSignature.empty();
+	}
+};
+
+struct PreprocessResult
+{
+	bool succeeded = false;
+
+	// identifies the compile output
+	Hash128 key;
+
+	// every file read, including the source itself
+	std::vector<IncludeDependency> dependencies;
+
+	// self-contained. compiling it needs no include handler
+	DxPtr<IDxcBlobUtf8> hlsl;
+};
+
+// the key of compiling the preprocessed source with args. -E does not change the preprocessed source, so entry points of one file can share it.
+inline Hash128 preprocessedKey( IDxcBlob* hlsl, const std::vector<const wchar_t*>& args )
+{
+	ShaderCacheKey key;
+	key.add( Compiler::compiler().version() );
+	for( const wchar_t* arg : args )
+	{
+		key.add( std::wstring( arg ) );
+	}
+	key.add( hlsl->GetBufferPointer(), hlsl->GetBufferSize() );
+	return key.hash();
+}
+
+// the key of the dependency manifest. it is known without reading the source.
+inline Hash128 recipeKey( const std::string& filename, const std::vector<const wchar_t*>& args )
+{
+	std::error_code ec;
+	ShaderCacheKey recipe;
+	recipe.add( std::string( "dependencies" ) );
+	recipe.add( Compiler::compiler().version() );
+	for( const wchar_t* arg : args )
+	{
+		recipe.add( std::wstring( arg ) );
+	}
+	recipe.add( std::filesystem::absolute( filename, ec ).wstring() );
+	return recipe.hash();
+}
+
+/*
+ Runs only the preprocessor. The key covers the compiler version, the arguments and the preprocessed source, so includes are covered as well.
+*/
+inline PreprocessResult preprocessShader( IDxcBlob* source, const std::wstring& sourcePath, const std::vector<const wchar_t*>& args )
+{
+	HRESULT hr;
+	DxPtr<IDxcIncludeHandler> pIncludeHandler;
+	hr = Compiler::compiler().dxUtils()->CreateDefaultIncludeHandler(pIncludeHandler.getAddressOf());
+	DX_ASSERT(hr == S_OK, "");
+	DxPtr<RecordingIncludeHandler> includeHandler( new RecordingIncludeHandler( pIncludeHandler.get() ) );
+
+	DxcBuffer buffer = { };
+	buffer.Ptr = source->GetBufferPointer();
+	buffer.Size = source->GetBufferSize();
+	buffer.Encoding = DXC_CP_ACP;
+
+	std::vector<const wchar_t*> args_preprocess = args;
+	args_preprocess.push_back(L"-P");
+	args_preprocess.push_back(L"preprocessed.hlsl");
+	DxPtr<IDxcResult> compileResult;
+	hr = Compiler::compiler().dxCompiler()->Compile(
+		&buffer,
+		args_preprocess.data(),
+		args_preprocess.size(),
+		includeHandler.get(),
+		IID_PPV_ARGS(compileResult.getAddressOf()) // Compiler output status, buffer, and errors.
+	);
+	DX_ASSERT(hr == S_OK, "");
+
+	DxPtr<IDxcBlobUtf8> hlsl;
+	DxPtr<IDxcBlobUtf16> name;
+	hr = compileResult->GetOutput(DXC_OUT_HLSL, IID_PPV_ARGS(hlsl.getAddressOf()), name.getAddressOf());
+
+	PreprocessResult result;
+	if( hlsl && hlsl->GetBufferSize() )
+	{
+		result.key = preprocessedKey( hlsl.get(), args );
+
+		includeHandler->record( sourcePath, buffer.Ptr, buffer.Size );
+		result.dependencies = includeHandler->dependencies();
+		result.hlsl = hlsl;
+		result.succeeded = true;
+	}
+	return result;
+}
+
+// returns the object, or nothing when the source has errors. warnings and errors are printed.
+inline DxPtr<IDxcBlob> tryCompileShader( IDxcBlob* source, const std::vector<const wchar_t*>& args )
+{
+	HRESULT hr;
+	DxPtr<IDxcIncludeHandler> pIncludeHandler;
+	hr = Compiler::compiler().dxUtils()->CreateDefaultIncludeHandler(pIncludeHandler.getAddressOf());
+	DX_ASSERT(hr == S_OK, "");
+
+	DxcBuffer buffer = { };
+	buffer.Ptr = source->GetBufferPointer();
+	buffer.Size = source->GetBufferSize();
+	buffer.Encoding = DXC_CP_ACP;
+
+	// Compile() takes LPCWSTR*
+	std::vector<LPCWSTR> arguments( args.begin(), args.end() );
+	DxPtr<IDxcResult> compileResult;
+	hr = Compiler::compiler().dxCompiler()->Compile(
+		&buffer,
+		arguments.data(),
+		arguments.size(),
+		pIncludeHandler.get(),
+		IID_PPV_ARGS(compileResult.getAddressOf()) // Compiler output status, buffer, and errors.
+	);
+	DX_ASSERT(hr == S_OK, "");
+
+	DxPtr<IDxcBlobUtf8> compileErrors;
+	hr = compileResult->GetOutput(DXC_OUT_ERRORS, IID_PPV_ARGS(compileErrors.getAddressOf()), nullptr);
+	DX_ASSERT(hr == S_OK, "");
+
+	DxPtr<IDxcBlob> ilBlob;
+	hr = compileResult->GetOutput(DXC_OUT_OBJECT, IID_PPV_ARGS(ilBlob.getAddressOf()), nullptr);
+	DX_ASSERT(hr == S_OK, "");
+
+	if( compileErrors.get() && compileErrors->GetStringLength() != 0 )
+	{
+		printf("Warnings and Errors:\n%s\n", compileErrors->GetStringPointer());
+	}
+	HRESULT status = S_OK;
+	compileResult->GetStatus( &status );
+	if( status != S_OK || !ilBlob.get() || ilBlob->GetBufferSize() == 0 )
+	{
+		return DxPtr<IDxcBlob>();
+	}
+	return ilBlob;
+}
+
+// returns the object. warnings and errors are printed.
+inline DxPtr<IDxcBlob> compileShader( IDxcBlob* source, const std::vector<const wchar_t*>& args )
+{
+	DxPtr<IDxcBlob> ilBlob = tryCompileShader( source, args );
+	DX_ASSERT(ilBlob.get(), "");
+	return ilBlob;
+}
+
+/*
+ A source file that is read and preprocessed at most once, however many entry points are compiled from it.
+ The preprocessor runs with the arguments of the first caller, so callers may only differ by the entry point.
+*/
+class ShaderSource
+{
+public:
+	ShaderSource( const ShaderSource& ) = delete;
+	void operator=( const ShaderSource& ) = delete;
+
+	ShaderSource( const std::string& filename ) : _filename( filename )
+	{
+	}
+	const std::string& filename() const
+	{
+		return _filename;
+	}
+	IDxcBlob* file()
+	{
+		std::call_once( _fileOnce, [this]() {
+			_file = DxPtr<IDxcBlob>( new DXCFileBlob( _filename.c_str() ) );
+		} );
+		return _file.get();
+	}
+	const PreprocessResult& preprocess( const std::vector<const wchar_t*>& args )
+	{
+		std::call_once( _preprocessOnce, [this, &args]() {
+			_preprocessed = preprocessShader( file(), std::filesystem::path( _filename ).wstring(), args );
+		} );
+		return _preprocessed;
+	}
+private:
+	std::string _filename;
+	std::once_flag _fileOnce;
+	std::once_flag _preprocessOnce;
+	DxPtr<IDxcBlob> _file;
+	PreprocessResult _preprocessed;
+};
+
+inline ShaderReflection reflectShader( IDxcBlob* ilBlob )
+{
+	HRESULT hr;
+	DxPtr<IDxcContainerReflection> reflectionContainer;
+	UINT32 shaderIdx;
+	hr = DxcCreateInstance(CLSID_DxcContainerReflection, IID_PPV_ARGS(reflectionContainer.getAddressOf()) );
+	DX_ASSERT(hr == S_OK, "");
+	hr = reflectionContainer->Load(ilBlob);
+	DX_ASSERT(hr == S_OK, "");
+	hr = reflectionContainer->FindFirstPartKind(DXC_PART_DXIL, &shaderIdx);
+	DX_ASSERT(hr == S_OK, "");
+
+	DxPtr<ID3D12ShaderReflection> reflection;
+	hr = reflectionContainer->GetPartReflection(shaderIdx, IID_PPV_ARGS(reflection.getAddressOf()));
+	DX_ASSERT(hr == S_OK, "");
+
+	D3D12_SHADER_DESC desc = {};
+	reflection->GetDesc(&desc);
+
+	ShaderReflection r;
+	UINT groupSizeX, groupSizeY, groupSizeZ;
+	reflection->GetThreadGroupSize(&groupSizeX, &groupSizeY, &groupSizeZ);
+	r.groupSize[0] = groupSizeX;
+	r.groupSize[1] = groupSizeY;
+	r.groupSize[2] = groupSizeZ;
+	r.directlyIndexed = ( reflection->GetRequiresFlags() & D3D_SHADER_REQUIRES_RESOURCE_DESCRIPTOR_HEAP_INDEXING ) != 0;
+
+	for (UINT i = 0; i < desc.BoundResources; ++i)
+	{
+		D3D12_SHADER_INPUT_BIND_DESC bind = {};
+		reflection->GetResourceBindingDesc(i, &bind);
+
+		// EzDx.hlsli. it is set by dispatchThreads() as root constants instead of a descriptor.
+		if (bind.Type == D3D_SIT_CBUFFER && strcmp(bind.Name, "EzDxDispatch") == 0)
+		{
+			r.hasDispatchConstants = true;
+			r.dispatchConstantsBindPoint = bind.BindPoint;
+			r.dispatchConstantsSpace = bind.Space;
+			continue;
+		}
+		if (bind.Type == D3D_SIT_CBUFFER && strcmp(bind.Name, "EzDxBindless") == 0)
+		{
+			r.hasBindlessConstants = true;
+			r.bindlessConstantsBindPoint = bind.BindPoint;
+			r.bindlessConstantsSpace = bind.Space;
+			continue;
+		}
+
+		ShaderBinding binding;
+		switch (bind.Type)
+		{
+		case D3D_SIT_CBUFFER:
+		{
+			binding.type = ShaderBindingType::CBV;
+			D3D12_SHADER_BUFFER_DESC cb = {};
+			reflection->GetConstantBufferByName(bind.Name)->GetDesc(&cb);
+			binding.bytes = cb.Size;
+			break;
+		}
+		case D3D_SIT_STRUCTURED:
+			binding.type = ShaderBindingType::SRV;
+			break;
+		case D3D_SIT_UAV_RWTYPED:
+			binding.type = ShaderBindingType::UAV;
+			binding.typed = true;
+			break;
+		case D3D_SIT_UAV_RWSTRUCTURED:
+			binding.type = ShaderBindingType::UAV;
+			break;
+		default:
+			DX_ASSERT(0, "");
+		}
+		binding.name = bind.Name;
+		binding.bindPoint = bind.BindPoint;
+		binding.space = bind.Space;
+		r.bindings.push_back( binding );
+	}
+	return r;
+}
+
+/*
+ Serializes a root signature written in the HLSL root signature language.
+ Going through DXC instead of D3D12SerializeRootSignature keeps this usable without D3D12.
+*/
+inline std::vector<uint8_t> compileRootSignature( const std::string& rootSignature )
+{
+	std::string source = "#define EzDxRootSignature \"" + rootSignature + "\"\n";
+
+	DxcBuffer buffer = { };
+	buffer.Ptr = source.data();
+	buffer.Size = source.size();
+	buffer.Encoding = DXC_CP_ACP;
+
+	const wchar_t* args[] = {
+		L"rootsignature.hlsl",
+		L"-T", L"rootsig_1_0",
+		L"-E", L"EzDxRootSignature",
+	};
+	DxPtr<IDxcResult> compileResult;
+	HRESULT hr = Compiler::compiler().dxCompiler()->Compile(
+		&buffer,
+		args,
+		sizeof( args ) / sizeof( args[0] ),
+		nullptr,
+		IID_PPV_ARGS(compileResult.getAddressOf())
+	);
+	DX_ASSERT(hr == S_OK, "");
+
+	DxPtr<IDxcBlob> blob;
+	hr = compileResult->GetOutput(DXC_OUT_OBJECT, IID_PPV_ARGS(blob.getAddressOf()), nullptr);
+	DX_ASSERT(hr == S_OK && blob && 0 < blob->GetBufferSize(), "");
+
+	const uint8_t* p = (const uint8_t*)blob->GetBufferPointer();
+	return std::vector<uint8_t>( p, p + blob->GetBufferSize() );
+}
+
+// derives the binding table and the root signature from the IL.
+inline ShaderBinary makeShaderBinary( IDxcBlob* ilBlob, const CompileOptions& options = CompileOptions() )
+{
+	ShaderBinary binary;
+	const uint8_t* il = (const uint8_t*)ilBlob->GetBufferPointer();
+	binary.il.assign( il, il + ilBlob->GetBufferSize() );
+	binary.reflection = reflectShader( ilBlob );
+	binary.reflection.assignRootParameters( options.rootConstantBudget, options.rootDescriptors );
+	binary.rootSignature = compileRootSignature( binary.reflection.rootSignature() );
+	return binary;
+}
+
+/*
+ Wall time spent in DXC, excluding cache hits. Whole-file kernel compiles can be compared against library compiles plus links.
+*/
+struct CompileStatistics
+{
+	int64_t kernels = 0;
+	int64_t kernelMicroseconds = 0;
+	int64_t libraries = 0;
+	int64_t libraryMicroseconds = 0;
+	int64_t links = 0;
+	int64_t linkMicroseconds = 0;
+};
+
+/*
+ A pool of worker threads for shader builds. Each worker compiles with its own DXC instances through Compiler::compiler().
+*/
+class CompileService
+{
+public:
+	CompileService( const CompileService& ) = delete;
+	void operator=( const CompileService& ) = delete;
+
+	CompileService( int threadCount )
+	{
+		for( int i = 0; i < std::max( threadCount, 1 ); ++i )
+		{
+			_threads.emplace_back( [this]() { run(); } );
+		}
+	}
+	~CompileService()
+	{
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			_quit = true;
+		}
+		_condition.notify_all();
+		for( std::thread& thread : _threads )
+		{
+			thread.join();
+		}
+	}
+	static CompileService& service()
+	{
+		static CompileService s( std::thread::hardware_concurrency() );
+		return s;
+	}
+	int threadCount() const
+	{
+		return _threads.size();
+	}
+
+	CompileStatistics statistics() const
+	{
+		CompileStatistics s;
+		s.kernels = _kernels;
+		s.kernelMicroseconds = _kernelMicroseconds;
+		s.libraries = _libraries;
+		s.libraryMicroseconds = _libraryMicroseconds;
+		s.links = _links;
+		s.linkMicroseconds = _linkMicroseconds;
+		return s;
+	}
+	void recordKernel( int64_t microseconds )
+	{
+		_kernels++;
+		_kernelMicroseconds += microseconds;
+	}
+	void recordLibrary( int64_t microseconds )
+	{
+		_libraries++;
+		_libraryMicroseconds += microseconds;
+	}
+	void recordLink( int64_t microseconds )
+	{
+		_links++;
+		_linkMicroseconds += microseconds;
+	}
+
+	template <class F>
+	std::future<std::invoke_result_t<F>> enqueue( F f )
+	{
+		typedef std::invoke_result_t<F> R;
+		std::shared_ptr<std::packaged_task<R()>> task( new std::packaged_task<R()>( std::move( f ) ) );
+		std::future<R> future = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			_tasks.push_back( [task]() { ( *task )(); } );
+		}
+		_condition.notify_one();
+		return future;
+	}
+private:
+	void run()
+	{
+		for( ;; )
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock( _mutex );
+				_condition.wait( lock, [&]() { return _quit || !_tasks.empty(); } );
+				if( _tasks.empty() )
+				{
+					return;
+				}
+				task = std::move( _tasks.front() );
+				_tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::atomic<int64_t> _kernels { 0 };
+	std::atomic<int64_t> _kernelMicroseconds { 0 };
+	std::atomic<int64_t> _libraries { 0 };
+	std::atomic<int64_t> _libraryMicroseconds { 0 };
+	std::atomic<int64_t> _links { 0 };
+	std::atomic<int64_t> _linkMicroseconds { 0 };
+
+	std::vector<std::thread> _threads;
+	std::deque<std::function<void()>> _tasks;
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	bool _quit = false;
+};
+
+// "cs_6_5" to "lib_6_5"
+inline std::string libraryTarget( const std::string& target )
+{
+	DX_ASSERT( target.compare( 0, 3, "cs_" ) == 0, "a compute target is expected" );
+	return "lib_" + target.substr( 3 );
+}
+
+// a blob that owns a copy of the bytes
+inline DxPtr<IDxcBlob> createBlob( const void* data, size_t bytes )
+{
+	IDxcBlobEncoding* blob = nullptr;
+	HRESULT hr = Compiler::compiler().dxUtils()->CreateBlob( data, (UINT32)bytes, DXC_CP_ACP, &blob );
+	DX_ASSERT( hr == S_OK, "" );
+	return DxPtr<IDxcBlob>( blob );
+}
+
+/*
+ Compiles the file with the library target of options.target. Like Shader, it is looked up by the dependency manifest
+ first and by the preprocessed source next, so unchanged files are never compiled again.
+*/
+inline DxPtr<IDxcBlob> compileLibrary( const std::string& filename, const std::string& includeDir, const CompileOptions& options )
+{
+	CompileOptions libraryOptions = options;
+	libraryOptions.target = libraryTarget( options.target );
+	libraryOptions.entryPoint.clear();
+
+	std::wstring source = std::filesystem::path( filename ).filename().wstring();
+	std::vector<std::wstring> arguments = libraryOptions.arguments( source, std::filesystem::path( includeDir ).wstring() );
+	std::vector<const wchar_t*> args;
+	for( const std::wstring& arg : arguments )
+	{
+		args.push_back( arg.c_str() );
+	}
+
+	Hash128 recipe = recipeKey( filename, args );
+	Hash128 key;
+	std::vector<uint8_t> cached;
+	if( ShaderCache::cache().loadDependencies( recipe, &key ) && ShaderCache::cache().load( key, &cached ) )
+	{
+		return createBlob( cached.data(), cached.size() );
+	}
+
+	ShaderSource shaderSource( filename );
+	DX_ASSERT( shaderSource.file()->GetBufferSize() != 0, "" );
+
+	PreprocessResult preprocessed = shaderSource.preprocess( args );
+	if( preprocessed.succeeded )
+	{
+		key = preprocessedKey( preprocessed.hlsl.get(), args );
+		ShaderCache::cache().storeDependencies( recipe, key, preprocessed.dependencies );
+		if( ShaderCache::cache().load( key, &cached ) )
+		{
+			return createBlob( cached.data(), cached.size() );
+		}
+	}
+
+	auto beg = std::chrono::steady_clock::now();
+	IDxcBlob* input = preprocessed.succeeded && options.mode != CompileMode::Debug ? preprocessed.hlsl.get() : shaderSource.file();
+	DxPtr<IDxcBlob> library = compileShader( input, args );
+	CompileService::service().recordLibrary( std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - beg ).count() );
+
+	if( preprocessed.succeeded )
+	{
+		ShaderCache::cache().store( key, library->GetBufferPointer(), library->GetBufferSize() );
+	}
+	return library;
+}
+
+// links the libraries into a kernel of target, e.g. "cs_6_5". warnings and errors are printed.
+inline DxPtr<IDxcBlob> linkShader( const std::string& entryPoint, const std::string& target, const std::vector<IDxcBlob*>& libraries )
+{
+	auto beg = std::chrono::steady_clock::now();
+
+	HRESULT hr;
+	DxPtr<IDxcLinker> linker;
+	hr = DxcCreateInstance( CLSID_DxcLinker, IID_PPV_ARGS( linker.getAddressOf() ) );
+	DX_ASSERT( hr == S_OK, "" );
+
+	std::vector<std::wstring> names;
+	for( size_t i = 0; i < libraries.size(); ++i )
+	{
+		names.push_back( L"lib" + std::to_wstring( i ) );
+		hr = linker->RegisterLibrary( names.back().c_str(), libraries[i] );
+		DX_ASSERT( hr == S_OK, "" );
+	}
+	std::vector<LPCWSTR> libNames;
+	for( const std::wstring& name : names )
+	{
+		libNames.push_back( name.c_str() );
+	}
+
+	std::wstring entry( entryPoint.begin(), entryPoint.end() );
+	std::wstring profile( target.begin(), target.end() );
+	DxPtr<IDxcOperationResult> linkResult;
+	hr = linker->Link( entry.c_str(), profile.c_str(), libNames.data(), (UINT32)libNames.size(), nullptr, 0, linkResult.getAddressOf() );
+	DX_ASSERT( hr == S_OK, "" );
+
+	DxPtr<IDxcBlobEncoding> linkErrors;
+	linkResult->GetErrorBuffer( linkErrors.getAddressOf() );
+	if( linkErrors.get() && linkErrors->GetBufferSize() != 0 )
+	{
+		printf( "Warnings and Errors:\n%.*s\n", (int)linkErrors->GetBufferSize(), (const char*)linkErrors->GetBufferPointer() );
+	}
+
+	HRESULT status = S_OK;
+	hr = linkResult->GetStatus( &status );
+	DX_ASSERT( hr == S_OK, "" );
+	DxPtr<IDxcBlob> ilBlob;
+	linkResult->GetResult( ilBlob.getAddressOf() );
+	DX_ASSERT( status == S_OK && ilBlob.get() && 0 < ilBlob->GetBufferSize(), "" );
+
+	CompileService::service().recordLink( std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - beg ).count() );
+	return ilBlob;
+}
+
+/*
+ Shared code compiled once as a DXIL library and linked into kernels, see Shader.
+ The functions the kernels call have to be declared export in it.
+*/
+class ShaderLibrary
+{
+public:
+	ShaderLibrary( const ShaderLibrary& ) = delete;
+	void operator=( const ShaderLibrary& ) = delete;
+
+	// options.target is the target of the kernels it is linked into, not the library target
+	ShaderLibrary( const std::string& filename, const std::string& includeDir, const CompileOptions& options = CompileOptions() )
+		: _filename( filename ), _includeDir( includeDir ), _options( options )
+	{
+	}
+	const CompileOptions& options() const
+	{
+		return _options;
+	}
+
+	// compiles or loads the library on first use. thread safe.
+	IDxcBlob* library()
+	{
+		build();
+		return _library.get();
+	}
+	// identifies the content of library()
+	Hash128 hash()
+	{
+		build();
+		return _hash;
+	}
+private:
+	void build()
+	{
+		std::call_once( _buildOnce, [this]() {
+			_library = compileLibrary( _filename, _includeDir, _options );
+			_hash = murmurHash3_128( _library->GetBufferPointer(), _library->GetBufferSize(), 0 );
+		} );
+	}
+
+	std::string _filename;
+	std::string _includeDir;
+	CompileOptions _options;
+	std::once_flag _buildOnce;
+	DxPtr<IDxcBlob> _library;
+	Hash128 _hash;
+};
+
+/*
+ Polls the files of every watch from one thread and calls back when the content of any of them changes.
+ Files are read and callbacks run without the lock, so add, update and remove never wait for a scan.
+ Callbacks run on the watcher thread, so they should only hand the work off.
+*/
+class FileWatcher
+{
+public:
+	FileWatcher( const FileWatcher& ) = delete;
+	void operator=( const FileWatcher& ) = delete;
+
+	FileWatcher()
+	{
+		_thread = std::thread( [this]() { run(); } );
+	}
+	~FileWatcher()
+	{
+		{
+			std::lock_guard<std::mutex> lock( _mutex );
+			_quit = true;
+		}
+		_condition.notify_all();
+		_thread.join();
+	}
+	static FileWatcher& watcher()
+	{
+		static FileWatcher w;
+		return w;
+	}
+	void setInterval( std::chrono::milliseconds interval )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_interval = interval;
+	}
+
+	uint64_t add( const std::vector<IncludeDependency>& dependencies, std::function<void()> changed )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		uint64_t id = ++_lastId;
+		Watch& w = _watches[id];
+		w.dependencies = dependencies;
+		w.changed = changed;
+		return id;
+	}
+	// replaces the files, e.g. when a rebuild reads other includes
+	void update( uint64_t id, const std::vector<IncludeDependency>& dependencies )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		auto it = _watches.find( id );
+		if( it != _watches.end() )
+		{
+			it->second.dependencies = dependencies;
+			it->second.version++;
+		}
+	}
+	// no callback of the watch runs after this returns, unless it is called from the callback itself
+	void remove( uint64_t id )
+	{
+		std::unique_lock<std::mutex> lock( _mutex );
+		_watches.erase( id );
+		if( std::this_thread::get_id() != _thread.get_id() )
+		{
+			_condition.wait( lock, [&]() { return _calling != id; } );
+		}
+	}
+private:
+	struct Watch
+	{
+		std::vector<IncludeDependency> dependencies;
+		std::function<void()> changed;
+		uint64_t version = 0;
+	};
+	struct Scan
+	{
+		uint64_t id;
+		uint64_t version;
+		std::vector<IncludeDependency> dependencies;
+		bool changed;
+	};
+	void run()
+	{
+		std::unique_lock<std::mutex> lock( _mutex );
+		while( !_condition.wait_for( lock, _interval, [&]() { return _quit; } ) )
+		{
+			std::vector<Scan> scans;
+			for( const auto& watch : _watches )
+			{
+				scans.push_back( { watch.first, watch.second.version, watch.second.dependencies, false } );
+			}
+
+			lock.unlock();
+			for( Scan& scan : scans )
+			{
+				for( IncludeDependency& d : scan.dependencies )
+				{
+					if( d.isUpToDate() )
+					{
+						continue;
+					}
+
+					// only a different content counts. saving without an edit or a missing file does not fire again.
+					IncludeDependency current = IncludeDependency::load( d.path );
+					scan.changed = scan.changed || current.bytes != d.bytes || !( current.hash == d.hash );
+					d = current;
+				}
+			}
+			lock.lock();
+
+			for( Scan& scan : scans )
+			{
+				// removed, or replaced by update() during the scan
+				auto it = _watches.find( scan.id );
+				if( it == _watches.end() || it->second.version != scan.version )
+				{
+					continue;
+				}
+				it->second.dependencies = scan.dependencies;
+				if( !scan.changed )
+				{
+					continue;
+				}
+
+				std::function<void()> changed = it->second.changed;
+				_calling = scan.id;
+				lock.unlock();
+				changed();
+				lock.lock();
+				_calling = 0;
+				_condition.notify_all();
+			}
+		}
+	}
+
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	std::chrono::milliseconds _interval { 250 };
+	std::map<uint64_t, Watch> _watches;
+	uint64_t _lastId = 0;
+	uint64_t _calling = 0; // the watch whose callback is running
+	bool _quit = false;
+	std::thread _thread;
+};
+
+/*
+ A read-only view of a whole file.
+*/
+class MappedFile
+{
+public:
+	MappedFile( const MappedFile& ) = delete;
+	void operator=( const MappedFile& ) = delete;
+
+	MappedFile()
+	{
+	}
+	~MappedFile()
+	{
+		close();
+	}
+	bool open( const std::string& file )
+	{
+		close();
+#if defined( _WIN32 )
+		std::wstring path = std::filesystem::path( file ).wstring();
+		_file = CreateFileW( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+		if( _file == INVALID_HANDLE_VALUE )
+		{
+			return false;
+		}
+		LARGE_INTEGER size = {};
+		if( !GetFileSizeEx( _file, &size ) || size.QuadPart == 0 )
+		{
+			close();
+			return false;
+		}
+		_mapping = CreateFileMappingW( _file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+		if( _mapping == nullptr )
+		{
+			close();
+			return false;
+		}
+		_data = MapViewOfFile( _mapping, FILE_MAP_READ, 0, 0, 0 );
+		if( _data == nullptr )
+		{
+			close();
+			return false;
+		}
+		_size = size.QuadPart;
+#else
+		_fd = ::open( file.c_str(), O_RDONLY );
+		if( _fd < 0 )
+		{
+			return false;
+		}
+		struct stat st = {};
+		if( fstat( _fd, &st ) != 0 || st.st_size == 0 )
+		{
+			close();
+			return false;
+		}
+		void* p = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0 );
+		if( p == MAP_FAILED )
+		{
+			close();
+			return false;
+		}
+		_data = p;
+		_size = st.st_size;
+#endif
+		return true;
+	}
+	void close()
+	{
+#if defined( _WIN32 )
+		if( _data )
+		{
+			UnmapViewOfFile( _data );
+		}
+		if( _mapping )
+		{
+			CloseHandle( _mapping );
+			_mapping = nullptr;
+		}
+		if( _file != INVALID_HANDLE_VALUE )
+		{
+			CloseHandle( _file );
+			_file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if( _data )
+		{
+			munmap( _data, _size );
+		}
+		if( 0 <= _fd )
+		{
+			::close( _fd );
+			_fd = -1;
+		}
+#endif
+		_data = nullptr;
+		_size = 0;
+	}
+	bool isOpen() const
+	{
+		return _data != nullptr;
+	}
+	const void* data() const
+	{
+		return _data;
+	}
+	size_t size() const
+	{
+		return _size;
+	}
+private:
+#if defined( _WIN32 )
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+#else
+	int _fd = -1;
+#endif
+	void* _data = nullptr;
+	size_t _size = 0;
+};
+
+namespace shaderpack
+{
+	enum
+	{
+		Magic = 0x50535a45, // "EZSP"
+		Version = 7,
+		Alignment = 16,
+	};
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t entryCount;
+	};
+
+	// sorted by key. offsets are from the beginning of the file.
+	struct Entry
+	{
+		Hash128 key;
+		uint64_t ilOffset;
+		uint64_t ilBytes;
+		uint64_t rootSignatureOffset;
+		uint64_t rootSignatureBytes;
+		uint64_t reflectionOffset;
+		uint64_t reflectionBytes;
+	};
+
+	// the name is the source path as given to the builder, e.g. "simple.hlsl".
+	inline Hash128 key( const std::string& name, const CompileOptions& options )
+	{
+		Hash128 variant = options.hash();
+		ShaderCacheKey key;
+		key.add( name );
+		key.add( &variant, sizeof( variant ) );
+		return key.hash();
+	}
+}
+
+/*
+ Points into a mapped ShaderPack. Nothing is copied except the reflection.
+*/
+struct ShaderPackEntry
+{
+	const void* il = nullptr;
+	size_t ilBytes = 0;
+	const void* rootSignature = nullptr;
+	size_t rootSignatureBytes = 0;
+	ShaderReflection reflection;
+};
+
+/*
+ Prebuilt shaders in one memory mapped archive, written by the shaderpack tool.
+*/
+class ShaderPack
+{
+public:
+	ShaderPack( const ShaderPack& ) = delete;
+	void operator=( const ShaderPack& ) = delete;
+
+	ShaderPack( const std::string& file )
+	{
+		if( !_file.open( file ) )
+		{
+			return;
+		}
+		const shaderpack::Header* header = (const shaderpack::Header*)_file.data();
+		if( _file.size() < sizeof( shaderpack::Header ) ||
+			header->magic != shaderpack::Magic ||
+			header->version != shaderpack::Version ||
+			( _file.size() - sizeof( shaderpack::Header ) ) / sizeof( shaderpack::Entry ) < header->entryCount )
+		{
+			_file.close();
+			return;
+		}
+		_entries = (const shaderpack::Entry*)( header + 1 );
+		_entryCount = header->entryCount;
+	}
+	bool isOpen() const
+	{
+		return _file.isOpen();
+	}
+	int64_t count() const
+	{
+		return _entryCount;
+	}
+	bool find( const std::string& name, const CompileOptions& options, ShaderPackEntry* entry ) const
+	{
+		Hash128 key = shaderpack::key( name, options );
+		const shaderpack::Entry* end = _entries + _entryCount;
+		const shaderpack::Entry* it = std::lower_bound( _entries, end, key, []( const shaderpack::Entry& e, const Hash128& k ) { return e.key < k; } );
+		if( it == end || !( it->key == key ) ||
+			!contains( it->ilOffset, it->ilBytes ) ||
+			!contains( it->rootSignatureOffset, it->rootSignatureBytes ) ||
+			!contains( it->reflectionOffset, it->reflectionBytes ) )
+		{
+			return false;
+		}
+		const uint8_t* base = (const uint8_t*)_file.data();
+		const uint8_t* reflection = base + it->reflectionOffset;
+		std::vector<uint8_t> bytes( reflection, reflection + it->reflectionBytes );
+		ByteReader reader( bytes );
+		if( !entry->reflection.read( &reader ) )
+		{
+			return false;
+		}
+		entry->il = base + it->ilOffset;
+		entry->ilBytes = it->ilBytes;
+		entry->rootSignature = base + it->rootSignatureOffset;
+		entry->rootSignatureBytes = it->rootSignatureBytes;
+		return true;
+	}
+private:
+	bool contains( uint64_t offset, uint64_t bytes ) const
+	{
+		return offset <= _file.size() && bytes <= _file.size() - offset;
+	}
+
+	MappedFile _file;
+	const shaderpack::Entry* _entries = nullptr;
+	uint64_t _entryCount = 0;
+};
+
+class ShaderPackWriter
+{
+public:
+	// thread safe
+	void add( const std::string& name, const CompileOptions& options, const ShaderBinary& binary )
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+		_binaries[shaderpack::key( name, options )] = binary;
+	}
+	bool write( const std::string& file ) const
+	{
+		std::lock_guard<std::mutex> lock( _mutex );
+
+		shaderpack::Header header = {};
+		header.magic = shaderpack::Magic;
+		header.version = shaderpack::Version;
+		header.entryCount = _binaries.size();
+
+		std::vector<shaderpack::Entry> entries;
+		std::vector<uint8_t> data;
+		uint64_t base = sizeof( header ) + sizeof( shaderpack::Entry ) * _binaries.size();
+		auto put = [&]( const void* p, size_t bytes, uint64_t* offset, uint64_t* size ) {
+			data.resize( alignedExpand( data.size(), shaderpack::Alignment ) );
+			*offset = base + data.size();
+			*size = bytes;
+			const uint8_t* b = (const uint8_t*)p;
+			data.insert( data.end(), b, b + bytes );
+		};
+		for( const auto& b : _binaries )
+		{
+			ByteWriter reflection;
+			b.second.reflection.write( &reflection );
+
+			shaderpack::Entry entry = {};
+			entry.key = b.first;
+			put( b.second.il.data(), b.second.il.size(), &entry.ilOffset, &entry.ilBytes );
+			put( b.second.rootSignature.data(), b.second.rootSignature.size(), &entry.rootSignatureOffset, &entry.rootSignatureBytes );
+			put( reflection.bytes().data(), reflection.bytes().size(), &entry.reflectionOffset, &entry.reflectionBytes );
+			entries.push_back( entry );
+		}
+
+		std::error_code ec;
+		std::filesystem::path tmpFile = file + ".tmp";
+		{
+			std::ofstream ofs( tmpFile, std::ios::binary );
+			ofs.write( (const char*)&header, sizeof( header ) );
+			ofs.write( (const char*)entries.data(), sizeof( shaderpack::Entry ) * entries.size() );
+			ofs.write( (const char*)data.data(), data.size() );
+			ofs.close();
+			if( ofs.fail() )
+			{
+				std::filesystem::remove( tmpFile, ec );
+				return false;
+			}
+		}
+		std::filesystem::rename( tmpFile, file, ec );
+		return !ec;
+	}
+private:
+	mutable std::mutex _mutex;
+	std::map<Hash128, ShaderBinary> _binaries;
+};
+
+} // ezdx
@@ -0,0 +1,47 @@
+// Set by ezdx::Shader as root constants. Keep the layout in sync with ezdx::DispatchConstants.
+cbuffer EzDxDispatch : register(b0, space100)
+{
+	uint3 ezdxGroupOffset;
+	uint ezdxFoldWidth;
+	uint3 ezdxThreadCount;
+	uint ezdxGroupThreads;
+	uint3 ezdxGroupSize;
+	uint ezdxFoldRows;
+	uint2 ezdxLinearGroupBase;
+	uint2 ezdxLinearThreadCount;
+};
+
+// Set by ezdx::Shader from ArgumentHeap::Bindless() as root constants. Keep the layout in sync with ezdx::BindlessConstants.
+// The indices are for ResourceDescriptorHeap, which needs cs_6_6, e.g.
+//   RWStructuredBuffer<float> src = ResourceDescriptorHeap[ezdxBindlessIndex(0)];
+cbuffer EzDxBindless : register(b1, space100)
+{
+	uint4 ezdxBindless[4];
+};
+uint ezdxBindlessIndex( uint slot )
+{
+	return ezdxBindless[slot / 4][slot % 4];
+}
+
+// for Shader::dispatchThreads( context, arg, threads ) and Shader::dispatch( context, arg, x, y, z )
+uint64_t ezdxLinearIndex( uint3 groupID, uint groupIndex )
+{
+	uint64_t base = ( (uint64_t)ezdxLinearGroupBase.y << 32 ) | ezdxLinearGroupBase.x;
+	uint64_t group = base + ( (uint64_t)groupID.z * ezdxFoldRows + groupID.y ) * ezdxFoldWidth + groupID.x;
+	return group * ezdxGroupThreads + groupIndex;
+}
+bool ezdxInRange( uint64_t linearIndex )
+{
+	uint64_t count = ( (uint64_t)ezdxLinearThreadCount.y << 32 ) | ezdxLinearThreadCount.x;
+	return linearIndex < count;
+}
+
+// for Shader::dispatchThreads( context, arg, x, y, z )
+uint3 ezdxThreadID( uint3 groupID, uint3 groupThreadID )
+{
+	return ( groupID + ezdxGroupOffset ) * ezdxGroupSize + groupThreadID;
+}
+bool ezdxInRange( uint3 threadID )
+{
+	return all( threadID < ezdxThreadCount );
+}
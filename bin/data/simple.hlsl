@@ -1,3 +1,5 @@
+#include "EzDx.hlsli"
+
 RWStructuredBuffer<float> src;
 RWStructuredBuffer<float> dst;
 
@@ -7,8 +9,13 @@ cbuffer arguments
 };
 
 [numthreads(64, 1, 1)]
-void main(uint3 gID : SV_DispatchThreadID)
+void main(uint3 groupID : SV_GroupID, uint groupIndex : SV_GroupIndex)
 {
-	float dataOut = bias + sin( src[gID.x] );
-	dst[gID.x] = dataOut;
+	uint64_t i = ezdxLinearIndex(groupID, groupIndex);
+	if (!ezdxInRange(i))
+	{
+		return;
+	}
+	float dataOut = bias + sin( src[(uint)i] );
+	dst[(uint)i] = dataOut;
 }
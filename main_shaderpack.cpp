@@ -0,0 +1,201 @@
+#include "EzDxCompiler.hpp"
+
+#include <sstream>
+
+/*
+ Builds a ShaderPack from a list of sources.
+
+ usage: shaderpack <list> <output> [-I <include dir>]
+
+ Each line of the list is a source path relative to the list, followed by its defines and options.
+ Alternatives separated by '|' expand into one variant each. The options are
+ "-debug" for CompileMode::Debug, "-E <entry>", "-T <target>", "-O0".."-O3", "-enable-16bit-types", "-HV <version>",
+ "-root-constants <DWORDs>" and "-root-descriptor <name>".
+
+	simple.hlsl
+	reduce.hlsl BLOCK=64|128|256 USE_WAVE=0|1
+	reduce.hlsl -E reduceHalf -T cs_6_6 -enable-16bit-types -HV 2021
+	scan.hlsl -root-constants 8 -root-descriptor items
+*/
+
+struct Variant
+{
+	std::string name;
+	std::string path;
+	ezdx::CompileOptions options;
+};
+
+static std::vector<std::string> split( const std::string& s, char delimiter )
+{
+	std::vector<std::string> items;
+	std::string item;
+	std::istringstream stream( s );
+	while( std::getline( stream, item, delimiter ) )
+	{
+		items.push_back( item );
+	}
+	return items;
+}
+
+static bool readList( const std::string& listFile, std::vector<Variant>* variants )
+{
+	std::ifstream ifs( listFile );
+	if( !ifs )
+	{
+		return false;
+	}
+	std::filesystem::path baseDir = std::filesystem::path( listFile ).parent_path();
+
+	std::string line;
+	while( std::getline( ifs, line ) )
+	{
+		line = line.substr( 0, line.find( '#' ) );
+
+		std::istringstream tokens( line );
+		std::string name;
+		if( !( tokens >> name ) )
+		{
+			continue;
+		}
+
+		ezdx::CompileOptions base;
+		ezdx::DefinePermutations permutations;
+		std::string token;
+		while( tokens >> token )
+		{
+			if( token == "-debug" )
+			{
+				base.mode = ezdx::CompileMode::Debug;
+				continue;
+			}
+			if( token == "-E" )
+			{
+				tokens >> base.entryPoint;
+				continue;
+			}
+			if( token == "-T" )
+			{
+				tokens >> base.target;
+				continue;
+			}
+			if( token.size() == 3 && token.compare( 0, 2, "-O" ) == 0 )
+			{
+				base.optimizationLevel = token[2] - '0';
+				continue;
+			}
+			if( token == "-enable-16bit-types" )
+			{
+				base.enable16BitTypes = true;
+				continue;
+			}
+			if( token == "-HV" )
+			{
+				tokens >> base.hlslVersion;
+				continue;
+			}
+			if( token == "-root-constants" )
+			{
+				tokens >> base.rootConstantBudget;
+				continue;
+			}
+			if( token == "-root-descriptor" )
+			{
+				std::string descriptor;
+				tokens >> descriptor;
+				base.rootDescriptors.insert( descriptor );
+				continue;
+			}
+			size_t eq = token.find( '=' );
+			std::string define = token.substr( 0, eq );
+			std::vector<std::string> values = eq == std::string::npos ? std::vector<std::string>{ "1" } : split( token.substr( eq + 1 ), '|' );
+			permutations.add( define, values );
+		}
+
+		for( const ezdx::CompileOptions& options : permutations.enumerate( base ) )
+		{
+			Variant v;
+			v.name = name;
+			v.path = ( baseDir / name ).string();
+			v.options = options;
+			variants->push_back( v );
+		}
+	}
+	return true;
+}
+
+int main( int argc, char** argv )
+{
+	if( argc < 3 )
+	{
+		printf( "usage: shaderpack <list> <output> [-I <include dir>]\n" );
+		return 1;
+	}
+	std::string listFile = argv[1];
+	std::string output = argv[2];
+	std::string includeDir = std::filesystem::path( listFile ).parent_path().string();
+	for( int i = 3; i + 1 < argc; ++i )
+	{
+		if( strcmp( argv[i], "-I" ) == 0 )
+		{
+			includeDir = argv[++i];
+		}
+	}
+
+	std::vector<Variant> variants;
+	if( !readList( listFile, &variants ) )
+	{
+		printf( "failed to read %s\n", listFile.c_str() );
+		return 1;
+	}
+
+	ezdx::ShaderPackWriter writer;
+	std::vector<std::future<bool>> builds;
+	for( const Variant& v : variants )
+	{
+		builds.push_back( ezdx::CompileService::service().enqueue( [&writer, &includeDir, v]() {
+			ezdx::DxPtr<IDxcBlob> source( new ezdx::DXCFileBlob( v.path.c_str() ) );
+			if( source->GetBufferSize() == 0 )
+			{
+				printf( "failed to read %s\n", v.path.c_str() );
+				return false;
+			}
+			std::wstring sourceName = std::filesystem::path( v.name ).filename().wstring();
+			std::vector<std::wstring> arguments = v.options.arguments( sourceName, std::filesystem::path( includeDir ).wstring() );
+			std::vector<const wchar_t*> args;
+			for( const std::wstring& arg : arguments )
+			{
+				args.push_back( arg.c_str() );
+			}
+			ezdx::DxPtr<IDxcBlob> il = ezdx::tryCompileShader( source.get(), args );
+			if( !il.get() )
+			{
+				std::string defines;
+				for( const auto& d : v.options.defines )
+				{
+					defines += " " + d.first + "=" + d.second;
+				}
+				printf( "failed to compile %s%s\n", v.name.c_str(), defines.c_str() );
+				return false;
+			}
+			writer.add( v.name, v.options, ezdx::makeShaderBinary( il.get(), v.options ) );
+			return true;
+		} ) );
+	}
+
+	bool succeeded = true;
+	for( std::future<bool>& build : builds )
+	{
+		succeeded = build.get() && succeeded;
+	}
+	if( !succeeded )
+	{
+		return 1;
+	}
+	if( !writer.write( output ) )
+	{
+		printf( "failed to write %s\n", output.c_str() );
+		return 1;
+	}
+	printf( "%d shaders -> %s\n", (int)variants.size(), output.c_str() );
+	return 0;
+}
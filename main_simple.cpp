@@ -12,7 +12,7 @@ void run( ezdx::DeviceObject* deviceObject )
 	{
 		float bias;
 	};
-	ezdx::ConstantBuffer<arguments> constantArg( deviceObject );
+	ezdx::ConstantBuffer<arguments> constantArg;
 	constantArg->bias = 10.0f;
 
 	std::unique_ptr<ezdx::BufferResource> valueBuffer0( new ezdx::BufferResource( deviceObject, ioDataBytes, sizeof( float ) ) );
@@ -27,15 +27,17 @@ void run( ezdx::DeviceObject* deviceObject )
 	valueBuffer0->unmapForWriting( deviceObject, 0, ioDataBytes );
 
 	ezdx::Shader shader( deviceObject, GetDataPath("simple.hlsl").c_str(), GetDataPath("").c_str(), ezdx::CompileMode::Debug );
-	std::unique_ptr<ezdx::ArgumentHeap> arg( shader.createArgumentHeap(deviceObject->device()) );
+	std::unique_ptr<ezdx::ArgumentHeap> arg( shader.createArgumentHeap(deviceObject) );
 	arg->RWStructured( "src", valueBuffer0.get());
 	arg->RWStructured( "dst", valueBuffer1.get());
 	arg->Constant("arguments", &constantArg);
 
+	ezdx::CommandContext context = deviceObject->begin();
 	for (int i = 0; i < 3; ++i)
 	{
-		shader.dispatch( deviceObject, arg.get(), ezdx::alignedExpand(numberOfElement, 64) / 64, 1, 1);
+		shader.dispatchThreads( context, arg.get(), numberOfElement );
 	}
+	context.submit();
 
 	ezdx::TypedView<float> value1View = valueBuffer1->mapTypedForReading<float>(deviceObject, 0, valueBuffer1->bytes());
 	//for (int i = 0; i < value1View.count(); ++i)
@@ -54,6 +56,7 @@ int main()
 {
 	using namespace pr;
 	SetDataDir(JoinPath(ExecutableDir(), "data"));
+	ezdx::ShaderCache::cache().setDirectory(JoinPath(ExecutableDir(), "shadercache"));
 
 	// Activate Debug Layer
 	ezdx::enableDebugLayer();
@@ -75,6 +78,7 @@ int main()
 		}
 
 		devices.push_back( std::shared_ptr<ezdx::DeviceObject>( new ezdx::DeviceObject( adapter.get() ) ) );
+		devices.back()->enablePipelineLibrary( JoinPath( ExecutableDir(), "shadercache/pipelines.bin" ) );
 		break;
 	}
 
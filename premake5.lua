@@ -1,5 +1,12 @@
 include "libs/PrLib"
 
+newoption {
+    trigger = "dxc-linux",
+    value = "DIR",
+    description = "Extracted DXC Linux release for shaderpack, with include/ and lib/libdxcompiler.so",
+    default = "libs/dxc_linux"
+}
+
 workspace "HogeProject"
     location "build"
     configurations { "Debug", "Release" }
@@ -15,13 +22,14 @@ externalproject "prlib"
 project "main"
     kind "ConsoleApp"
     language "C++"
+    cppdialect "C++17"
     targetdir "bin/"
     systemversion "latest"
     flags { "MultiProcessorCompile", "NoPCH" }
 
     -- Src
     files { "main_simple.cpp" }
-    files { "EzDx.hpp", "EzDx.natvis" }
+    files { "EzDx.hpp", "EzDxCompiler.hpp", "EzDx.natvis" }
 
     -- Helper
     files { "libs/d3dx12/*.h" }
@@ -63,3 +71,40 @@ project "main"
         targetname ("Main")
         optimize "Full"
     filter{}
+
+project "shaderpack"
+    kind "ConsoleApp"
+    language "C++"
+    cppdialect "C++17"
+    targetdir "bin/"
+    flags { "MultiProcessorCompile", "NoPCH" }
+
+    -- Src
+    files { "main_shaderpack.cpp", "EzDxCompiler.hpp" }
+
+    -- HLSL compiler. on Linux, the headers of the DXC Linux release come first for dxcapi.h and dxc/Support/WinAdapter.h.
+    filter {"system:linux"}
+        includedirs { _OPTIONS["dxc-linux"] .. "/include", _OPTIONS["dxc-linux"] .. "/include/dxc" }
+        libdirs { _OPTIONS["dxc-linux"] .. "/lib" }
+        links { "dxcompiler", "pthread" }
+    filter {"system:windows"}
+        systemversion "latest"
+        links { "libs/dxc_2021_07_01/lib/x64/dxcompiler" }
+        postbuildcommands { 
+            "{COPY} ../libs/dxc_2021_07_01/bin/x64/dxcompiler.dll ../bin",
+            "{COPY} ../libs/dxc_2021_07_01/bin/x64/dxil.dll ../bin",
+        }
+    filter{}
+    includedirs { "libs/dxc_2021_07_01/inc" }
+
+    symbols "On"
+
+    filter {"Debug"}
+        runtime "Debug"
+        targetname ("shaderpack_d")
+        optimize "Off"
+    filter {"Release"}
+        runtime "Release"
+        targetname ("shaderpack")
+        optimize "Full"
+    filter{}